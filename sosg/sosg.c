@@ -37,16 +37,46 @@ Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
 #endif /* USE_SOSG_VIDEO */
 #include "sosg_predict.h"
 #include "sosg_tracker.h"
+#include "sosg_soft.h"
+#include "sosg_event.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h> // TODO: use the windows equivalent when on windows
+#include <getopt.h>
 #include <math.h>
 
-#define TICK_INTERVAL 33
-#define ROTATION_INTERVAL M_PI/(120.0*(1000.0/TICK_INTERVAL))
+#define DEFAULT_REFRESH 60 // when the display doesn't tell us its rate
+#define ROTATION_INTERVAL M_PI/120.0 // radians per second
 #define ROTATION_CONSTANT (float)30.5*ROTATION_INTERVAL
 #define CLOSE_ENOUGH(a, b) (fabs(a - b) < ROTATION_INTERVAL/2)
+#define PBO_COUNT 3 // enough that we never map a buffer the GPU is still reading
+#define TILE_BORDER 4 // texels of the neighboring tiles copied around each tile
+#define DISC_SEGMENTS 64
+#define CACHE_FRAMES 64 // decoded images kept around the current one
+#define CACHE_MB 1024 // and the most memory they can take up
+#define TEXTURE_RING 4 // the current image, the one fading out and a neighbor each way
+#define SCRUB_TURN 10000 // milliseconds of video per turn of the Tracker
+#define ATTRIB_POSITION 0
+#define ATTRIB_TEXCOORD 1
+
+enum sosg_stage {
+    STAGE_EVENTS,
+    STAGE_MEDIA,
+    STAGE_TEXTURE,
+    STAGE_DISPLAY,
+    STAGE_SWAP,
+    STAGE_COUNT
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+    "handle_events",
+    "update_media",
+    "load_texture",
+    "update_display",
+    "swap"
+};
 
 enum sosg_mode {
     SOSG_IMAGES,
@@ -54,11 +84,33 @@ enum sosg_mode {
     SOSG_PREDICT
 };
 
+// A texture that fits a whole frame, kept on the GPU for as long as it holds
+// an image that may be shown again
+typedef struct sosg_texture_struct {
+    GLuint id;
+    int size[2];
+    GLenum format;
+    sosg_frame_p frame; // the image it holds, or NULL if it can't be reused
+    int pass; // the last prefetch that wanted it
+} sosg_texture_t, *sosg_texture_p;
+
 typedef struct sosg_struct {
     int w;
     int h;
     int fullscreen;
     int mirror;
+    int report;
+    int lut;
+    int naive;
+    int cpu;
+    int compress;
+    int full_size;
+    int cache_frames;
+    float fps;
+    int cache_mb;
+    float fade;
+    int huge;
+    int bench;
     int texres[2];
     float ratio;
     float radius;
@@ -66,7 +118,18 @@ typedef struct sosg_struct {
     float center[2];
     float rotation;
     float drotation;
-    uint32_t time;
+    float dt;
+    int dirty;
+    int vsync;
+    int max_fps;
+    int refresh;
+    uint64_t frame_interval;
+    uint64_t deadline;
+    uint64_t last_frame;
+    uint64_t last_swap;
+    uint64_t startup;
+    int frames;
+    int missed;
     int index;
     int mode;
     // TODO: use function pointers for different sources
@@ -83,22 +146,498 @@ typedef struct sosg_struct {
     SDL_Surface *screen;
     SDL_Surface *text;
     SDL_GLContext glcontext;
-    GLuint texture;
+    SDL_Renderer *renderer;
+    SDL_Texture *canvas;
+    SDL_Surface *frame;
+    sosg_soft_p soft;
+    sosg_texture_t textures[TEXTURE_RING];
+    int ring;
+    int current;
+    int previous;
+    int pass;
+    uint64_t fade_start;
+    // The chroma planes of YUV video, with the luma in the ring
+    sosg_texture_t chroma[2];
+    int planar;
+    const GLfloat *yuv;
+    // Tiles are a texture array sampled from GLSL 1.30, so need OpenGL 3.0
+    int can_tile;
+    int can_generate_mipmap; // or else the driver does it on every upload
+    GLuint tiles;
+    int tiled;
+    int tilegrid[2];
+    int tilesize[2];
+    int max_texture;
+    float anisotropy;
+    int texsize[2]; // of the frame in the tiles
+    GLuint pbo[PBO_COUNT];
+    int pbo_index;
+    // Persistently mapped for VLC to decode into, when the driver can
+    GLuint video_pbo;
+    uint8_t *video_memory;
+    size_t video_size;
+    int video_upload;
+    GLsync video_fence;
+    GLuint lut_texture;
+    GLuint fbo;
+    GLuint fbo_color;
+    GLuint vbo;
+    GLuint vao;
     GLuint program;
     GLuint vertex;
     GLuint fragment;
     GLuint lrotation;
     GLuint ltexres;
+    GLuint lfade;
+    GLuint lyuv;
 } sosg_t, *sosg_p;
 
-static void load_texture(sosg_p data, SDL_Surface *surface)
+// YUV to RGB for video range Y'CbCr, column major, for SD and HD video
+static const GLfloat yuv_bt601[9] = {
+    1.164384, 1.164384, 1.164384,
+    0.0, -0.391762, 2.017232,
+    1.596027, -0.812968, 0.0
+};
+static const GLfloat yuv_bt709[9] = {
+    1.164384, 1.164384, 1.164384,
+    0.0, -0.213249, 2.112402,
+    1.792741, -0.532909, 0.0
+};
+
+// Milliseconds since *last, which is then reset to now
+static float lap(uint64_t *last)
 {
-    // Bind the texture object
-    glBindTexture(GL_TEXTURE_2D, data->texture);
-    
-    // Edit the texture object's image data using the information SDL_Surface gives us
-    glTexImage2D(GL_TEXTURE_2D, 0, 4, surface->w, surface->h, 0, 
-                  GL_BGRA, GL_UNSIGNED_BYTE, surface->pixels);
+    uint64_t now = SDL_GetPerformanceCounter();
+    float ms = (double)(now - *last)*1000.0/(double)SDL_GetPerformanceFrequency();
+    *last = now;
+    return ms;
+}
+
+static int load_shaders(sosg_p data);
+
+static void alloc_tiles(sosg_p data, SDL_Surface *surface)
+{
+    GLint loc;
+    int usable = data->max_texture - 2*TILE_BORDER;
+
+    // Split the frame into a grid of equally sized tiles that each fit in
+    // a layer of a texture array, with a border around each one so that
+    // filtering doesn't show the seams
+    data->tilegrid[0] = (surface->w + usable - 1)/usable;
+    data->tilegrid[1] = (surface->h + usable - 1)/usable;
+    data->tilesize[0] = (surface->w + data->tilegrid[0] - 1)/data->tilegrid[0];
+    data->tilesize[1] = (surface->h + data->tilegrid[1] - 1)/data->tilegrid[1];
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, data->tiles);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8,
+                 data->tilesize[0] + 2*TILE_BORDER, data->tilesize[1] + 2*TILE_BORDER,
+                 data->tilegrid[0]*data->tilegrid[1], 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+
+    loc = glGetUniformLocation(data->program, "tilegrid");
+    glUniform2f(loc, data->tilegrid[0], data->tilegrid[1]);
+    loc = glGetUniformLocation(data->program, "tilesize");
+    glUniform2f(loc, data->tilesize[0], data->tilesize[1]);
+    loc = glGetUniformLocation(data->program, "tileborder");
+    glUniform1f(loc, TILE_BORDER);
+}
+
+static void upload_tile_rows(sosg_p data, SDL_Surface *surface, const void *pixels,
+                             int layer, int x, int y, int row, int rows)
+{
+    // Copy rows starting at source row into the layer at y, wrapping around
+    // in longitude like GL_REPEAT would
+    int width = data->tilesize[0] + 2*TILE_BORDER;
+    int done = 0;
+
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, row);
+    while (done < width) {
+        int column = ((x + done) % surface->w + surface->w) % surface->w;
+        int n = SDL_min(width - done, surface->w - column);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, column);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, done, y, layer, n, rows, 1,
+                        GL_BGRA, GL_UNSIGNED_BYTE, pixels);
+        done += n;
+    }
+}
+
+static void upload_tiles(sosg_p data, SDL_Surface *surface, const void *pixels)
+{
+    int i, j, y;
+    int height = data->tilesize[1] + 2*TILE_BORDER;
+
+    for (j = 0; j < data->tilegrid[1]; j++) {
+        for (i = 0; i < data->tilegrid[0]; i++) {
+            int layer = j*data->tilegrid[0] + i;
+            int x0 = i*data->tilesize[0] - TILE_BORDER;
+            int y0 = j*data->tilesize[1] - TILE_BORDER;
+            int first = SDL_max(y0, 0);
+            int last = SDL_min(y0 + height, surface->h);
+
+            // The rows inside the frame go up in one block per column run,
+            // and the rows past the top and bottom repeat the edge
+            upload_tile_rows(data, surface, pixels, layer, x0, first - y0, first, last - first);
+            for (y = y0; y < first; y++) {
+                upload_tile_rows(data, surface, pixels, layer, x0, y - y0, 0, 1);
+            }
+            for (y = last; y < y0 + height; y++) {
+                upload_tile_rows(data, surface, pixels, layer, x0, y - y0, surface->h - 1, 1);
+            }
+        }
+    }
+
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+}
+
+// Copy a frame into the next PBO in the ring, returning what to pass as the
+// pixels to glTex*Image, which is either an offset into the bound PBO or the
+// client memory if mapping failed.  Orphaning the buffer means we never wait
+// on a transfer that is still in flight, and the texture update itself
+// becomes an asynchronous DMA.
+static const uint8_t *stream_pixels(sosg_p data, const void *pixels, int size)
+{
+    // Video frames may already be in a pixel buffer, so there's nothing to copy
+    const uint8_t *p = pixels;
+    if (data->video_memory && p >= data->video_memory &&
+        p + size <= data->video_memory + data->video_size) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, data->video_pbo);
+        data->video_upload = 1;
+        return (const uint8_t *)NULL + (p - data->video_memory);
+    }
+
+    data->pbo_index = (data->pbo_index + 1) % PBO_COUNT;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, data->pbo[data->pbo_index]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+
+    void *mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (mapped) {
+        memcpy(mapped, pixels, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        return NULL;
+    }
+
+    // Mapping can fail if we run out of address space, so just update from
+    // client memory instead
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return pixels;
+}
+
+// OpenGL 2.1 only has glGenerateMipmap with ARB_framebuffer_object, but can
+// have the driver make the mipmaps as the base level is uploaded instead
+static void auto_mipmap(sosg_p data, int generate)
+{
+    if (!data->can_generate_mipmap) {
+        glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, generate && !data->naive);
+    }
+}
+
+static void generate_mipmap(sosg_p data, GLenum target)
+{
+    if (!data->naive && data->can_generate_mipmap) glGenerateMipmap(target);
+}
+
+static void upload_compressed(sosg_p data, sosg_texture_p texture, sosg_frame_p frame)
+{
+    int i, total = 0;
+    int w = frame->w;
+    int h = frame->h;
+
+    int realloc = w != texture->size[0] || h != texture->size[1] ||
+                  frame->internal != texture->format;
+    const uint8_t *pixels = frame->data;
+    if (realloc) {
+        // Only sample the levels the frame actually has
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, frame->levels - 1);
+        texture->size[0] = w;
+        texture->size[1] = h;
+        texture->format = frame->internal;
+    } else {
+        for (i = 0; i < frame->levels; i++) total += frame->sizes[i];
+        pixels = stream_pixels(data, frame->data, total);
+    }
+
+    // Every level comes from the frame, since glGenerateMipmap can't
+    // compress what it generates
+    auto_mipmap(data, 0);
+    for (i = 0; i < frame->levels; i++) {
+        if (realloc) {
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, frame->internal, w, h, 0,
+                                   frame->sizes[i], pixels);
+        } else {
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, w, h, frame->internal,
+                                      frame->sizes[i], pixels);
+        }
+        pixels += frame->sizes[i];
+        w = w > 1 ? w/2 : 1;
+        h = h > 1 ? h/2 : 1;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+static void upload_surface(sosg_p data, sosg_texture_p texture, SDL_Surface *surface)
+{
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, surface->pitch/surface->format->BytesPerPixel);
+
+    const void *pixels = stream_pixels(data, surface->pixels, surface->pitch*surface->h);
+    auto_mipmap(data, 1);
+    if (surface->w != texture->size[0] || surface->h != texture->size[1] ||
+        texture->format != GL_RGBA) {
+        // The resolution changed (or this is the first frame), so allocate
+        // new storage along with the upload
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surface->w, surface->h, 0,
+                      GL_BGRA, GL_UNSIGNED_BYTE, pixels);
+        texture->size[0] = surface->w;
+        texture->size[1] = surface->h;
+        texture->format = GL_RGBA;
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, surface->w, surface->h,
+                        GL_BGRA, GL_UNSIGNED_BYTE, pixels);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    // The shader picks a level from the footprint of each pixel on the source
+    generate_mipmap(data, GL_TEXTURE_2D);
+}
+
+static void upload_plane(sosg_p data, sosg_texture_p texture, const uint8_t *pixels,
+                         int w, int h, int pitch)
+{
+    glBindTexture(GL_TEXTURE_2D, texture->id);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch);
+    auto_mipmap(data, 1);
+    if (w != texture->size[0] || h != texture->size[1] || texture->format != GL_LUMINANCE8) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE8, w, h, 0,
+                     GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels);
+        texture->size[0] = w;
+        texture->size[1] = h;
+        texture->format = GL_LUMINANCE8;
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    // Each plane is filtered on its own and converted after sampling
+    generate_mipmap(data, GL_TEXTURE_2D);
+}
+
+// Upload the luma of a planar YUV frame into texture and the chroma into
+// their own textures, all from one copy, leaving the conversion to RGB to the
+// shader.  That's 1.5 bytes a pixel instead of 4.
+static void upload_planar(sosg_p data, sosg_texture_p texture, sosg_frame_p frame)
+{
+    int w = (frame->w + 1)/2;
+    int h = (frame->h + 1)/2;
+    const uint8_t *pixels = stream_pixels(data, frame->data,
+        frame->sizes[0] + frame->sizes[1] + frame->sizes[2]);
+
+    upload_plane(data, texture, pixels, frame->w, frame->h, frame->pitches[0]);
+    pixels += frame->sizes[0];
+    upload_plane(data, &data->chroma[0], pixels, w, h, frame->pitches[1]);
+    pixels += frame->sizes[1];
+    upload_plane(data, &data->chroma[1], pixels, w, h, frame->pitches[2]);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // Going by the resolution, like most players, since VLC doesn't say
+    const GLfloat *yuv = frame->h > 576 ? yuv_bt709 : yuv_bt601;
+    if (yuv != data->yuv) {
+        data->yuv = yuv;
+        glUniformMatrix3fv(data->lyuv, 1, GL_FALSE, yuv);
+    }
+}
+
+// Upload a frame that fits in a single texture into texture i of the ring
+static void upload_texture(sosg_p data, int i, sosg_frame_p frame)
+{
+    sosg_texture_p texture = &data->textures[i];
+
+    glBindTexture(GL_TEXTURE_2D, texture->id);
+    if (frame->format == SOSG_FRAME_I420) upload_planar(data, texture, frame);
+    else if (frame->surface) upload_surface(data, texture, frame->surface);
+    else upload_compressed(data, texture, frame);
+
+    // Only the image source keeps a frame at the same place for as long as
+    // it shows the same image, the others reuse theirs for the next one
+    texture->frame = data->mode == SOSG_IMAGES && !frame->preview ? frame : NULL;
+    texture->pass = data->pass;
+}
+
+// The texture of the ring holding frame, or -1 if it isn't resident
+static int find_texture(sosg_p data, sosg_frame_p frame)
+{
+    int i;
+    for (i = 0; i < data->ring; i++) {
+        if (data->textures[i].frame == frame) return i;
+    }
+    return -1;
+}
+
+// The texture to upload a new frame into, which is one that doesn't hold an
+// image or else the one the prefetching wanted least recently, but never the
+// one on screen or the one fading out
+static int free_texture(sosg_p data)
+{
+    int i, best = -1;
+
+    if (data->ring == 1) return 0;
+    for (i = 0; i < data->ring; i++) {
+        if (i == data->current || i == data->previous) continue;
+        if (!data->textures[i].frame) return i;
+        if (best < 0 || data->textures[i].pass < data->textures[best].pass) best = i;
+    }
+    return best;
+}
+
+// Draw from texture i of the ring from now on, fading over from the one
+// shown until now if asked to
+static void show_texture(sosg_p data, int i)
+{
+    sosg_texture_p texture = &data->textures[i];
+    int planar = texture->format == GL_LUMINANCE8;
+
+    if (data->tiled || planar != data->planar) {
+        data->tiled = 0;
+        data->planar = planar;
+        load_shaders(data);
+    } else if (i != data->current && data->fade > 0.0 && data->ring > 1 &&
+               data->textures[data->current].size[0]) {
+        data->previous = data->current;
+        data->fade_start = SDL_GetPerformanceCounter();
+    }
+    data->current = i;
+
+    // Keep the shader's filter offsets in step with the resolution
+    if (texture->size[0] != data->texres[0] || texture->size[1] != data->texres[1]) {
+        data->texres[0] = texture->size[0];
+        data->texres[1] = texture->size[1];
+        glUniform2f(data->ltexres, 1.0/(float)data->texres[0], 1.0/(float)data->texres[1]);
+    }
+}
+
+// Have VLC decode straight into a persistently mapped pixel buffer, sized for
+// the first frame, so uploading a video frame doesn't copy it at all
+static void map_video_memory(sosg_p data, sosg_frame_p frame)
+{
+#ifdef USE_SOSG_VIDEO
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    if (!SDL_GL_ExtensionSupported("GL_ARB_buffer_storage") ||
+        !SDL_GL_ExtensionSupported("GL_ARB_sync")) return;
+
+    // Every slot starts on a page, like the pool's
+    size_t frame_size = (size_t)frame->w*frame->h*4;
+    if (frame->format == SOSG_FRAME_I420) {
+        frame_size = (size_t)frame->sizes[0] + frame->sizes[1] + frame->sizes[2];
+    }
+    frame_size = (frame_size + 4095) & ~(size_t)4095;
+    data->video_size = frame_size*SOSG_VIDEO_SLOTS;
+    glGenBuffers(1, &data->video_pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, data->video_pbo);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, data->video_size, NULL, flags);
+    data->video_memory = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, data->video_size, flags);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (data->video_memory) {
+        sosg_video_set_memory(data->source.video, data->video_memory, frame_size);
+    } else {
+        fprintf(stderr, "Warning: Could not map a pixel buffer for video, copying frames instead\n");
+    }
+#endif /* USE_SOSG_VIDEO */
+}
+
+// Mark when the GPU is done with a frame uploaded from the mapped memory
+static void fence_video(sosg_p data)
+{
+    if (data->video_upload) {
+        if (data->video_fence) glDeleteSync(data->video_fence);
+        data->video_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        data->video_upload = 0;
+    }
+}
+
+static void load_tiles(sosg_p data, SDL_Surface *surface)
+{
+    // Frames too big for a single texture are split up into tiles, which
+    // needs a different shader, and can't be faded from
+    if (!data->tiled) {
+        data->tiled = 1;
+        data->planar = 0;
+        data->previous = -1;
+        data->texsize[0] = data->texsize[1] = 0;
+        load_shaders(data);
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, data->tiles);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, surface->pitch/surface->format->BytesPerPixel);
+
+    if (surface->w != data->texsize[0] || surface->h != data->texsize[1]) {
+        alloc_tiles(data, surface);
+        data->texsize[0] = data->texres[0] = surface->w;
+        data->texsize[1] = data->texres[1] = surface->h;
+        glUniform2f(data->ltexres, 1.0/(float)data->texres[0], 1.0/(float)data->texres[1]);
+    }
+
+    const void *pixels = stream_pixels(data, surface->pixels, surface->pitch*surface->h);
+    upload_tiles(data, surface, pixels);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    fence_video(data);
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    generate_mipmap(data, GL_TEXTURE_2D_ARRAY);
+}
+
+static void load_texture(sosg_p data, sosg_frame_p frame)
+{
+    uint64_t start = SDL_GetPerformanceCounter();
+    SDL_Surface *surface = frame->surface;
+
+    if (data->soft) {
+        // The software renderer samples straight from the source surface
+        if (surface) data->frame = surface;
+        else fprintf(stderr, "Warning: Compressed frames can't be shown by the software renderer\n");
+        return;
+    }
+
+    if (frame->w > data->max_texture || frame->h > data->max_texture) {
+        // Compressed blocks can't be split up with glPixelStorei, so there
+        // is no tiled path for them
+        if (surface && data->can_tile) {
+            load_tiles(data, surface);
+        } else {
+            fprintf(stderr, "Warning: Frame of %dx%d is too big for a %d texture\n",
+                frame->w, frame->h, data->max_texture);
+            return;
+        }
+        if (data->report) {
+            printf("Upload: %dx%d tiled in %.3f ms\n", frame->w, frame->h, lap(&start));
+        }
+        return;
+    }
+
+    // Text is blended into the frame, which reads it back, and the mapping is
+    // write only and uncached, so frames under text are decoded to the heap
+    if (data->mode == SOSG_VIDEO && !data->video_pbo && !data->text) {
+        map_video_memory(data, frame);
+    }
+
+    // Images that were uploaded ahead of time only need to be bound
+    int i = find_texture(data, frame);
+    int resident = i >= 0;
+    if (!resident) {
+        i = free_texture(data);
+        upload_texture(data, i, frame);
+    }
+    show_texture(data, i);
+    fence_video(data);
+
+    if (data->report) {
+        printf("Upload: %dx%d%s in %.3f ms\n", frame->w, frame->h,
+            resident ? " already resident" : frame->format == SOSG_FRAME_I420 ? " planar" :
+            surface ? "" : " compressed", lap(&start));
+    }
 }
 
 static char *load_file(char *filename)
@@ -124,9 +663,75 @@ static char *load_file(char *filename)
 	return buf;
 }
 
+static void bake_lut(sosg_p data)
+{
+    int i, j;
+    float height = data->height/data->radius;
+    float *lut = malloc(data->w*data->h*3*sizeof(float));
+    if (!lut) {
+        fprintf(stderr, "Error: Could not allocate lookup table\n");
+        return;
+    }
+
+    // Evaluate the fisheye mapping of sosg.frag at the center of every pixel.
+    // Only the rotation changes per frame, so we store the mapping without it
+    // and a flag for whether the pixel is on the globe at all.
+    for (j = 0; j < data->h; j++) {
+        for (i = 0; i < data->w; i++) {
+            float *m = lut + (j*data->w + i)*3;
+            float x = (((float)i + 0.5)/(float)data->w - data->center[0])*data->ratio;
+            float y = ((float)j + 0.5)/(float)data->h - data->center[1];
+            float d = sqrt(x*x + y*y);
+            if (d > data->radius) {
+                m[0] = m[1] = m[2] = 0.0;
+            } else {
+                float h = d*M_SQRT1_2/data->radius;
+                float theta = asin(height*h) + asin(h);
+                float phi = atan2(x, y);
+                m[0] = -phi/(2.0*M_PI);
+                m[1] = theta/M_PI_2;
+                m[2] = 1.0;
+            }
+        }
+    }
+
+    if (!data->lut_texture) glGenTextures(1, &data->lut_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, data->lut_texture);
+    // Sample exactly one texel per pixel, interpolating across the seam in
+    // longitude would smear the whole image
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F_ARB, data->w, data->h, 0,
+                  GL_RGB, GL_FLOAT, lut);
+    glActiveTexture(GL_TEXTURE0);
+
+    free(lut);
+}
+
+static GLuint compile_shader(GLenum type, const GLchar **sources, int count)
+{
+    GLint status;
+    GLuint shader = glCreateShader(type);
+
+    glShaderSource(shader, count, sources, NULL);
+    glCompileShader(shader);
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Error: Failed to compile shader: %s\n", log);
+    }
+
+    return shader;
+}
+
 static int load_shaders(sosg_p data)
 {
     char *vbuf, *fbuf;
+    const GLchar *vsources[2];
+    const GLchar *fsources[6];
     
     vbuf = load_file("sosg.vert");
     if (vbuf) {
@@ -139,21 +744,33 @@ static int load_shaders(sosg_p data)
         return 1;
     }
     
-    data->vertex = glCreateShader(GL_VERTEX_SHADER);
-    data->fragment = glCreateShader(GL_FRAGMENT_SHADER);
+    // The shaders get rebuilt when switching to or from tiled textures
+    if (data->program) {
+        glDeleteProgram(data->program);
+        glDeleteShader(data->vertex);
+        glDeleteShader(data->fragment);
+    }
     
-    glShaderSource(data->vertex, 1, (const GLchar **)&vbuf, NULL);
-    glShaderSource(data->fragment, 1, (const GLchar **)&fbuf, NULL);
+    // Optional features of the fragment shader are switched on with defines.
+    // Texture arrays need GLSL 1.30, so both shaders get that version.
+    vsources[0] = fsources[0] = data->tiled ? "#version 130\n#define SOSG_TILED\n" : "";
+    fsources[1] = data->lut ? "#define SOSG_LUT\n" : "";
+    fsources[2] = data->naive ? "#define SOSG_NAIVE_FILTER\n" : "";
+    fsources[3] = data->fade > 0.0 && !data->tiled ? "#define SOSG_CROSSFADE\n" : "";
+    fsources[4] = data->planar ? "#define SOSG_YUV\n" : "";
+    fsources[5] = fbuf;
+    vsources[1] = vbuf;
+    data->vertex = compile_shader(GL_VERTEX_SHADER, vsources, 2);
+    data->fragment = compile_shader(GL_FRAGMENT_SHADER, fsources, 6);
     
     free(vbuf);
     free(fbuf);
     
-    glCompileShader(data->vertex);
-    glCompileShader(data->fragment);
-    
     data->program = glCreateProgram();
     glAttachShader(data->program, data->vertex);
     glAttachShader(data->program, data->fragment);
+    glBindAttribLocation(data->program, ATTRIB_POSITION, "position");
+    glBindAttribLocation(data->program, ATTRIB_TEXCOORD, "texcoord");
     glLinkProgram(data->program);
     glUseProgram(data->program);
     
@@ -167,8 +784,28 @@ static int load_shaders(sosg_p data)
     loc = glGetUniformLocation(data->program, "ratio");
     glUniform1f(loc, data->ratio);
     data->ltexres = glGetUniformLocation(data->program, "texres");
-    glUniform2f(data->ltexres, 1.0/(float)data->texres[0], 1.0/(float)data->texres[1]);
+    // Sources that load in the background don't know it yet, in which case
+    // load_texture sets it with the first frame
+    if (data->texres[0] && data->texres[1]) {
+        glUniform2f(data->ltexres, 1.0/(float)data->texres[0], 1.0/(float)data->texres[1]);
+    }
     data->lrotation = glGetUniformLocation(data->program, "rotation");
+    data->lfade = glGetUniformLocation(data->program, "fade");
+    loc = glGetUniformLocation(data->program, "previous");
+    glUniform1i(loc, 2);
+    loc = glGetUniformLocation(data->program, "texu");
+    glUniform1i(loc, 3);
+    loc = glGetUniformLocation(data->program, "texv");
+    glUniform1i(loc, 4);
+    data->lyuv = glGetUniformLocation(data->program, "yuv");
+    if (data->yuv) glUniformMatrix3fv(data->lyuv, 1, GL_FALSE, data->yuv);
+
+    if (data->lut) {
+        // The calibration is fixed from here on, so bake the mapping once
+        loc = glGetUniformLocation(data->program, "lut");
+        glUniform1i(loc, 1);
+        if (!data->lut_texture) bake_lut(data);
+    }
     
     return 0;
 }
@@ -187,22 +824,102 @@ static void setup_overlay(sosg_p data, char *text)
     TTF_Quit();
 }
 
-static int setup(sosg_p data)
+static int setup_soft(sosg_p data);
+static int setup_gl(sosg_p data);
+
+static void bind_disc(sosg_p data)
 {
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        fprintf(stderr, "Error: Unable to initialize SDL: %s\n", SDL_GetError());
-        return 1;
+    glBindBuffer(GL_ARRAY_BUFFER, data->vbo);
+    glEnableVertexAttribArray(ATTRIB_POSITION);
+    glVertexAttribPointer(ATTRIB_POSITION, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), (void *)0);
+    glEnableVertexAttribArray(ATTRIB_TEXCOORD);
+    glVertexAttribPointer(ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float),
+                          (void *)(2*sizeof(float)));
+}
+
+static void setup_disc(sosg_p data)
+{
+    int i;
+    float vertices[(DISC_SEGMENTS+2)*4];
+    // The polygon has to enclose the circle the shader projects onto, so
+    // push its vertices out past the radius
+    float radius = data->radius/cos(M_PI/DISC_SEGMENTS);
+
+    // A fan around the center of the globe with the screen position in
+    // normalized device coordinates and the texture coordinate the fisheye
+    // mapping works on, which is flipped when mirroring
+    for (i = 0; i < DISC_SEGMENTS+2; i++) {
+        float *v = vertices + i*4;
+        float s = data->center[0];
+        float t = data->center[1];
+        if (i > 0) {
+            float angle = 2.0*M_PI*(float)(i-1)/(float)DISC_SEGMENTS;
+            s += radius*cos(angle)/data->ratio;
+            t += radius*sin(angle);
+        }
+        v[0] = data->mirror ? 1.0 - 2.0*s : 2.0*s - 1.0;
+        v[1] = 1.0 - 2.0*t;
+        v[2] = s;
+        v[3] = t;
     }
-    
-    data->time = SDL_GetTicks();
 
-    // Have the cursor hidden and stuck inside the window
-    SDL_ShowCursor(SDL_DISABLE);
-    if (SDL_SetRelativeMouseMode(1)) {
-        fprintf(stderr, "Warning: Unable to capture mouse: %s\n", SDL_GetError());
+    glGenBuffers(1, &data->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, data->vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+    // Keep the vertex layout in a vertex array object when we can, otherwise
+    // it gets set up again for every draw
+    if (SDL_GL_ExtensionSupported("GL_ARB_vertex_array_object")) {
+        glGenVertexArrays(1, &data->vao);
+        glBindVertexArray(data->vao);
+        bind_disc(data);
     }
+}
+
+static void setup_pacing(sosg_p data)
+{
+    SDL_DisplayMode mode;
+    uint64_t freq = SDL_GetPerformanceFrequency();
 
-    uint32_t flags = SDL_WINDOW_OPENGL;
+    data->refresh = DEFAULT_REFRESH;
+    if (!SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(data->window), &mode)
+            && mode.refresh_rate > 0) {
+        data->refresh = mode.refresh_rate;
+    }
+
+    // Without vsync we time frames to the refresh rate ourselves, and with
+    // it we only need to step in to cap the frame rate to save power
+    data->frame_interval = 0;
+    if (data->max_fps > 0 && data->max_fps < data->refresh) {
+        data->frame_interval = freq/data->max_fps;
+    } else if (!data->vsync) {
+        data->frame_interval = freq/data->refresh;
+    }
+
+    data->last_frame = data->deadline = data->last_swap = SDL_GetPerformanceCounter();
+    data->dt = 1.0/(float)data->refresh;
+}
+
+// Just enough to have events and know the size of the window, so the sources
+// can start loading while the window and renderer are set up
+static int setup_sdl(sosg_p data)
+{
+    SDL_DisplayMode mode;
+
+    // Benchmarks don't need a display at all, with SDL's offscreen driver
+    // from 2.0.22 on, so they run on machines without one.  Older versions
+    // don't have it, and fall back on the usual one.
+    int offscreen = data->bench && !SDL_getenv("SDL_VIDEODRIVER");
+    if (offscreen) SDL_setenv("SDL_VIDEODRIVER", "offscreen", 1);
+    int ret = SDL_Init(SDL_INIT_VIDEO);
+    if (ret && offscreen) {
+        SDL_setenv("SDL_VIDEODRIVER", "", 1);
+        ret = SDL_Init(SDL_INIT_VIDEO);
+    }
+    if (ret) {
+        fprintf(stderr, "Error: Unable to initialize SDL: %s\n", SDL_GetError());
+        return 1;
+    }
 
     uint32_t num_displays = SDL_GetNumVideoDisplays();
     if (data->display >= num_displays) {
@@ -211,6 +928,27 @@ static int setup(sosg_p data)
         return 1;
     }
 
+    // Benchmarks render offscreen
+    if (data->bench) data->fullscreen = 0;
+    if (data->fullscreen && !SDL_GetDesktopDisplayMode(data->display, &mode)) {
+        data->w = mode.w;
+        data->h = mode.h;
+    }
+
+    return 0;
+}
+
+static int setup(sosg_p data)
+{
+    // Have the cursor hidden and stuck inside the window
+    SDL_ShowCursor(SDL_DISABLE);
+    if (!data->bench && SDL_SetRelativeMouseMode(1)) {
+        fprintf(stderr, "Warning: Unable to capture mouse: %s\n", SDL_GetError());
+    }
+
+    uint32_t flags = data->cpu ? 0 : SDL_WINDOW_OPENGL;
+    if (data->bench) flags |= SDL_WINDOW_HIDDEN;
+
     if (data->fullscreen) {
         data->window = SDL_CreateWindow("Science on a Snow Globe", SDL_WINDOWPOS_UNDEFINED_DISPLAY(data->display),
                                         SDL_WINDOWPOS_UNDEFINED_DISPLAY(data->display), 0, 0,
@@ -227,6 +965,42 @@ static int setup(sosg_p data)
 		return 1;
 	}
 
+    return data->cpu ? setup_soft(data) : setup_gl(data);
+}
+
+static int setup_soft(sosg_p data)
+{
+    // Let SDL pick whatever renderer works, which is its own software one
+    // on machines without a usable OpenGL driver
+    data->renderer = SDL_CreateRenderer(data->window, -1,
+                                        data->bench ? 0 : SDL_RENDERER_PRESENTVSYNC);
+    if (!data->renderer) {
+        fprintf(stderr, "Error: Unable to create renderer: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    SDL_RendererInfo info;
+    if (!SDL_GetRendererInfo(data->renderer, &info)) {
+        data->vsync = (info.flags & SDL_RENDERER_PRESENTVSYNC) != 0;
+    }
+
+    data->canvas = SDL_CreateTexture(data->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                     SDL_TEXTUREACCESS_STREAMING, data->w, data->h);
+    if (!data->canvas) {
+        fprintf(stderr, "Error: Unable to create streaming texture: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    data->soft = sosg_soft_init(data->w, data->h, data->ratio, data->radius,
+                                data->height, data->center, data->mirror,
+                                SDL_GetCPUCount());
+    return data->soft ? 0 : 1;
+}
+
+static int setup_gl(sosg_p data)
+{
+    int i;
+
     data->glcontext = SDL_GL_CreateContext(data->window);
     if (!data->glcontext) {
         fprintf(stderr, "Error: Unable to create GLContext: %s\n", SDL_GetError());
@@ -234,39 +1008,130 @@ static int setup(sosg_p data)
         return 1;
     }
 	
+    // OpenGL 3.0 has everything, otherwise only mipmaps have an extension
+    int major = 0;
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version) sscanf(version, "%d", &major);
+    data->can_tile = major >= 3;
+    data->can_generate_mipmap = major >= 3 ||
+        SDL_GL_ExtensionSupported("GL_ARB_framebuffer_object");
+
     // Set the OpenGL state after creating the context with SDL_SetVideoMode
 	glClearColor(0, 0, 0, 0);
-	glEnable(GL_TEXTURE_2D); // Need this to display a texture
     glViewport(0, 0, data->w, data->h);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0, data->w, data->h, 0, -1, 1);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    
-    // Have OpenGL generate a texture object handle for us
-    glGenTextures(1, &data->texture);
+    setup_disc(data);
     
-    // Bind the texture object
-    glBindTexture(GL_TEXTURE_2D, data->texture);
+    if (!data->bench) {
+        // Prefer adaptive vsync, which tears instead of halving the rate
+        // when we're late for a refresh
+        data->vsync = !SDL_GL_SetSwapInterval(-1) || !SDL_GL_SetSwapInterval(1);
+    }
     
-    // Set the texture's stretching properties
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // Near the edge of the globe the footprint is very anisotropic
+    if (!data->naive && SDL_GL_ExtensionSupported("GL_EXT_texture_filter_anisotropic")) {
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &data->anisotropy);
+    }
+
+    // Slideshows keep the images next to the current one on the GPU so
+    // moving to them doesn't wait on an upload, while the other sources
+    // replace their one frame
+    data->ring = data->mode == SOSG_IMAGES ? TEXTURE_RING : 1;
+    data->previous = -1;
+    for (i = 0; i < data->ring + 2; i++) {
+        // The chroma planes of video are sampled just like the frames
+        sosg_texture_p texture = i < data->ring ? &data->textures[i] : &data->chroma[i - data->ring];
+
+        // Have OpenGL generate a texture object handle for us
+        glGenTextures(1, &texture->id);
+        glBindTexture(GL_TEXTURE_2D, texture->id);
+
+        // Set the texture's stretching properties
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                        data->naive ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        if (data->anisotropy > 0.0) {
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, data->anisotropy);
+        }
+    }
+
+    // Only compress on the loader thread if the GPU can sample the result
+    if (data->compress && !SDL_GL_ExtensionSupported("GL_EXT_texture_compression_s3tc")) {
+        fprintf(stderr, "Warning: DXT1 textures are not supported, loading images uncompressed\n");
+        data->compress = 0;
+        if (data->mode == SOSG_IMAGES) sosg_image_set_compress(data->source.images, 0);
+    }
+
+    // Frames bigger than this get split into tiles of a texture array, or
+    // without those, are scaled down to fit as they're loaded
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &data->max_texture);
+    if (data->can_tile) {
+        glGenTextures(1, &data->tiles);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, data->tiles);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                        data->naive ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        // The borders take care of wrapping around
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (data->anisotropy > 0.0) {
+            glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, data->anisotropy);
+        }
+    } else if (data->mode == SOSG_IMAGES) {
+        sosg_image_set_max_size(data->source.images, data->max_texture);
+    }
+
+    // Pixel buffers for streaming new frames into the texture
+    glGenBuffers(PBO_COUNT, data->pbo);
+
+    if (data->bench) {
+        // Don't let vsync hide the cost of a frame, and draw into a
+        // framebuffer object since the window is never shown
+        SDL_GL_SetSwapInterval(0);
+        glGenRenderbuffers(1, &data->fbo_color);
+        glBindRenderbuffer(GL_RENDERBUFFER, data->fbo_color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, data->w, data->h);
+        glGenFramebuffers(1, &data->fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, data->fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER, data->fbo_color);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Error: Unable to create offscreen framebuffer\n");
+            return 1;
+        }
+    }
     
     return 0;
 }
 
 static void update_timer(sosg_p data)
 {
-    uint32_t now = SDL_GetTicks();
+    uint64_t now = SDL_GetPerformanceCounter();
+    uint64_t freq = SDL_GetPerformanceFrequency();
 
-    if (data->time > now) {
-        SDL_Delay(data->time - now);
+    if (data->frame_interval) {
+        if (data->deadline > now) {
+            SDL_Delay((data->deadline - now)*1000/freq);
+            now = SDL_GetPerformanceCounter();
+        }
+
+        while (data->deadline <= now) {
+            data->deadline += data->frame_interval;
+        }
     }
 
-    while (data->time <= now) {
-        data->time += TICK_INTERVAL;
+    // Everything animates by the real time that passed, so a late frame
+    // doesn't slow down the rotation
+    data->dt = (double)(now - data->last_frame)/(double)freq;
+    data->last_frame = now;
+    data->frames++;
+
+    // Count the refreshes we didn't present a new frame for
+    float period = data->frame_interval ? (double)data->frame_interval/(double)freq
+                                        : 1.0/(float)data->refresh;
+    if (data->dt > 1.5*period) {
+        int missed = (int)(data->dt/period + 0.5) - 1;
+        data->missed += missed;
+        if (data->report) printf("Missed %d frames\n", missed);
     }
 }
 
@@ -274,15 +1139,15 @@ static void update_index(sosg_p data)
 {
     switch (data->mode) {
         case SOSG_IMAGES:
+            // The resolution can change between images, but load_texture
+            // takes care of updating the shader when it does
             sosg_image_set_index(data->source.images, data->index);
-            // The resolution can change between images, so update the shader
-            sosg_image_get_resolution(data->source.images, data->texres);
-            glUniform2f(data->ltexres, 1.0/(float)data->texres[0], 1.0/(float)data->texres[1]);
             break;
 #ifdef USE_SOSG_VIDEO
         case SOSG_VIDEO:
+            // Videos can differ in resolution too, which load_texture picks
+            // up from their frames
             sosg_video_set_index(data->source.video, data->index);
-            // Video resolution is currently fixed, but this may change in the future
             break;
 #endif /* USE_SOSG_VIDEO */
         case SOSG_PREDICT:
@@ -296,6 +1161,9 @@ static int handle_events(sosg_p data)
     
     // TODO: handle key repeat interval again
     while (SDL_PollEvent(&event)) {
+        // Anything but a source waking us up may change what's on screen
+        if (event.type != SOSG_EVENT_WAKE) data->dirty = 1;
+
         switch (event.type) {
             case SDL_KEYDOWN:
                 switch (event.key.keysym.sym) {
@@ -363,72 +1231,194 @@ static int handle_events(sosg_p data)
     return 0;
 }
 
-static void update_media(sosg_p data)
+// Performance counter ticks between the frames we present
+static uint64_t frame_period(sosg_p data)
+{
+    if (data->frame_interval) return data->frame_interval;
+    return SDL_GetPerformanceFrequency()/data->refresh;
+}
+
+static void overlay_text(sosg_p data, sosg_frame_p frame)
+{
+    // The text can't be drawn into compressed frames, or ones mapped straight
+    // from a pack.  Frames that are shown again, or were uploaded ahead of
+    // time, already have it, and blending it again would darken its edges.
+    if (frame->surface && data->text && !frame->readonly && !frame->overlaid) {
+        SDL_Rect pos;
+        pos.x = 0;
+        // Center the text vertically
+        pos.y = frame->surface->h/2-data->text->h/2;
+        SDL_BlitSurface(data->text, NULL, frame->surface, &pos);
+        frame->overlaid = 1;
+    }
+}
+
+static sosg_frame_p update_media(sosg_p data)
 {
-    SDL_Surface *surface = NULL;
+    sosg_frame_p frame = NULL;
 
     switch (data->mode) {
         case SOSG_IMAGES:
-            surface = sosg_image_update(data->source.images);
+            frame = sosg_image_update(data->source.images);
             break;
 #ifdef USE_SOSG_VIDEO
         case SOSG_VIDEO:
-            surface = sosg_video_update(data->source.video);
+            // Updating hands the last frame back to VLC to decode into, so
+            // the GPU has to be done reading it from the mapped memory.
+            // That was a frame ago, so this hardly ever waits.
+            if (data->video_fence) {
+                glClientWaitSync(data->video_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+                glDeleteSync(data->video_fence);
+                data->video_fence = 0;
+            }
+            sosg_video_set_clock(data->source.video, data->last_swap, frame_period(data));
+            frame = sosg_video_update(data->source.video);
             break;
 #endif /* USE_SOSG_VIDEO */
         case SOSG_PREDICT:
-            surface = sosg_predict_update(data->source.predict);
+            frame = sosg_predict_update(data->source.predict);
             break;
     }
 
-    if (surface) {
-        if (data->text) {
-            SDL_Rect pos;
-            pos.x = 0;
-            // Center the text vertically
-            pos.y = surface->h/2-data->text->h/2;
-            SDL_BlitSurface(data->text, NULL, surface, &pos);
-        }
-    
-        // TODO: Support arbitrary resolution images
-        // Check that the image's dimensions are a power of 2
-        if ((surface->w & (surface->w - 1)) != 0 ||
-            (surface->h & (surface->h - 1)) != 0) {
-            fprintf(stderr, "Warning: dimensions (%d, %d) not a power of 2\n",
-                surface->w, surface->h);
-        }
-    
-        load_texture(data, surface);
+    if (frame) overlay_text(data, frame);
+    return frame;
+}
+
+// Upload the nearest image the user may move to next into the ring while
+// there's nothing else to upload, so moving to it only has to bind it.
+// Returns 1 if it uploaded one, in which case there may be more to do.
+static int prefetch_texture(sosg_p data)
+{
+    uint64_t start = SDL_GetPerformanceCounter();
+    int k, offset = 0;
+    sosg_frame_p frame;
+
+    if (data->ring < 2) return 0;
+
+    // Mark the neighbors that are resident already, ahead first, so they
+    // aren't replaced by a farther one
+    data->pass++;
+    for (k = 0; k < TEXTURE_RING - 2; k++) {
+        int o = k % 2 ? -(k/2 + 1) : k/2 + 1;
+        frame = sosg_image_peek(data->source.images, o);
+        if (!frame || frame->w > data->max_texture || frame->h > data->max_texture) continue;
+        int i = find_texture(data, frame);
+        if (i >= 0) data->textures[i].pass = data->pass;
+        else if (!offset) offset = o;
+    }
+    if (!offset) return 0;
+
+    // Peeking again keeps it loaded while uploading it
+    frame = sosg_image_peek(data->source.images, offset);
+    if (!frame) return 0;
+    overlay_text(data, frame);
+    upload_texture(data, free_texture(data), frame);
+
+    if (data->report) {
+        printf("Prefetch: %dx%d in %.3f ms\n", frame->w, frame->h, lap(&start));
+    }
+    return 1;
+}
+
+static void update_display_soft(sosg_p data)
+{
+    void *pixels;
+    int pitch;
+    uint64_t start = SDL_GetPerformanceCounter();
+
+    if (data->frame && !SDL_LockTexture(data->canvas, NULL, &pixels, &pitch)) {
+        sosg_soft_render(data->soft, data->frame, data->rotation, pixels, pitch);
+        SDL_UnlockTexture(data->canvas);
+    }
+
+    if (data->report) {
+        printf("Render: %dx%d in %.3f ms\n", data->w, data->h, lap(&start));
     }
 }
 
 static void update_display(sosg_p data)
 {
+    if (data->soft) {
+        update_display_soft(data);
+        return;
+    }
+
     glUniform1f(data->lrotation, data->rotation);
 
     // Clear the screen before drawing
 	glClear(GL_COLOR_BUFFER_BIT);
+
+    // Blend from the image shown before over the fade time
+    float fade = 1.0;
+    if (data->previous >= 0) {
+        fade = (double)(SDL_GetPerformanceCounter() - data->fade_start)/
+               (double)SDL_GetPerformanceFrequency()/data->fade;
+        if (fade >= 1.0) {
+            fade = 1.0;
+            data->previous = -1;
+        } else {
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, data->textures[data->previous].id);
+        }
+    }
+    glUniform1f(data->lfade, fade);
     
+    if (data->planar) {
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, data->chroma[0].id);
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D, data->chroma[1].id);
+    }
+
     // Bind the texture to which subsequent calls refer to
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, data->texture);
+    if (data->tiled) glBindTexture(GL_TEXTURE_2D_ARRAY, data->tiles);
+    else glBindTexture(GL_TEXTURE_2D, data->textures[data->current].id);
 
-    // Just make a full screen quad, a canvas for the shader to draw on
-    glBegin(GL_QUADS);
-        glTexCoord2i(data->mirror, 0);
-        glVertex3f(0, 0, 0);
-    
-        glTexCoord2i(!data->mirror, 0);
-        glVertex3f(data->w, 0, 0);
-    
-        glTexCoord2i(!data->mirror, 1);
-        glVertex3f(data->w, data->h, 0);
-    
-        glTexCoord2i(data->mirror, 1);
-        glVertex3f(0, data->h, 0);
-    glEnd();
-	
-    SDL_GL_SwapWindow(data->window);
+    // Only the globe itself gets drawn, everything around it stays cleared
+    if (data->vao) glBindVertexArray(data->vao);
+    else bind_disc(data);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, DISC_SEGMENTS+2);
+}
+
+static void swap_display(sosg_p data)
+{
+    if (data->soft) {
+        SDL_RenderCopy(data->renderer, data->canvas, NULL, NULL);
+        SDL_RenderPresent(data->renderer);
+    } else {
+        SDL_GL_SwapWindow(data->window);
+        // Wait for the GPU so the frame's cost is accounted to this stage
+        if (data->bench) glFinish();
+    }
+    // Which with vsync is about when the refresh happened
+    data->last_swap = SDL_GetPerformanceCounter();
+}
+
+static void wait_for_change(sosg_p data)
+{
+    // Nothing on screen would change, so block until there is an input event
+    // or one of the sources wakes us up with something new, or until an image
+    // sequence is due to move on or a video frame is due to be drawn
+    int delay = -1;
+    if (data->mode == SOSG_IMAGES) delay = sosg_image_get_delay(data->source.images);
+#ifdef USE_SOSG_VIDEO
+    if (data->mode == SOSG_VIDEO) delay = sosg_video_get_delay(data->source.video);
+#endif /* USE_SOSG_VIDEO */
+    if (delay >= 0) SDL_WaitEventTimeout(NULL, delay);
+    else SDL_WaitEvent(NULL);
+
+    // The time spent idle shouldn't count as missed frames or rotation
+    data->last_frame = data->deadline = SDL_GetPerformanceCounter();
+}
+
+// Scroll through the current video by the Tracker's rotation, which the
+// video counts from wherever it was when scrolling started
+static void scrub_video(sosg_p data, float rotation)
+{
+#ifdef USE_SOSG_VIDEO
+    sosg_video_scrub(data->source.video, (int64_t)(rotation/(2.0*M_PI)*SCRUB_TURN));
+#endif /* USE_SOSG_VIDEO */
 }
 
 static void update_input(sosg_p data)
@@ -437,14 +1427,124 @@ static void update_input(sosg_p data)
         float rotation = data->rotation;
         int mode;
         sosg_tracker_get_rotation(data->tracker, &rotation, &mode);
-        if (mode == TRACKER_ROTATE)
+#ifdef USE_SOSG_VIDEO
+        // Doesn't do anything unless the video was being scrubbed
+        if (mode != TRACKER_SCROLL && data->mode == SOSG_VIDEO) {
+            sosg_video_play(data->source.video);
+        }
+#endif /* USE_SOSG_VIDEO */
+        if (mode == TRACKER_ROTATE && data->rotation != -rotation) {
             data->rotation = -rotation;
+            data->dirty = 1;
+        }
+        else if (mode == TRACKER_SCROLL && data->mode == SOSG_VIDEO) {
+            scrub_video(data, rotation);
+        }
         else if (mode == TRACKER_SCROLL) {
-            data->index = rotation / (M_PI/3.0);
-            update_index(data);
+            int index = rotation / (M_PI/3.0);
+            if (index != data->index) {
+                data->index = index;
+                update_index(data);
+            }
+        }
+    } else if (data->drotation != 0.0) {
+        data->rotation += data->drotation*data->dt;
+        data->dirty = 1;
+    }
+
+    // Keep drawing until the crossfade is done
+    if (data->previous >= 0) data->dirty = 1;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static void print_bench(sosg_p data, float *times, int frames)
+{
+    int i, j;
+    float *sorted = malloc(frames*sizeof(float));
+    if (!sorted || !frames) {
+        free(sorted);
+        return;
+    }
+
+    printf("Benchmark: %d frames at %dx%d with %s\n", frames, data->w, data->h,
+        data->cpu ? "the software renderer" : "OpenGL");
+    printf("%-16s %9s %9s %9s\n", "stage (ms)", "p50", "p95", "p99");
+    for (i = 0; i < STAGE_COUNT; i++) {
+        for (j = 0; j < frames; j++) {
+            sorted[j] = times[j*STAGE_COUNT + i];
         }
+        qsort(sorted, frames, sizeof(float), compare_floats);
+        // Nearest rank percentiles
+        printf("%-16s %9.3f %9.3f %9.3f\n", stage_names[i],
+            sorted[(frames*50 + 99)/100 - 1], sorted[(frames*95 + 99)/100 - 1],
+            sorted[(frames*99 + 99)/100 - 1]);
+    }
+
+    free(sorted);
+}
+
+static int run_bench(sosg_p data)
+{
+    int frame;
+    uint64_t last;
+    float *times = calloc(data->bench*STAGE_COUNT, sizeof(float));
+    if (!times) {
+        fprintf(stderr, "Error: Could not allocate benchmark timings\n");
+        return 1;
+    }
+
+    // Keep the globe turning so every frame does the same work
+    if (!data->tracker) data->drotation = ROTATION_CONSTANT;
+    data->dt = 1.0/(float)data->refresh;
+
+    // The same loop as main, but timed per stage and without waiting for
+    // the next tick
+    for (frame = 0; frame < data->bench; frame++) {
+        float *t = times + frame*STAGE_COUNT;
+        last = SDL_GetPerformanceCounter();
+        if (handle_events(data) == -1) break;
+        t[STAGE_EVENTS] = lap(&last);
+        sosg_frame_p media = update_media(data);
+        t[STAGE_MEDIA] = lap(&last);
+        if (media) load_texture(data, media);
+        t[STAGE_TEXTURE] = lap(&last);
+        update_display(data);
+        t[STAGE_DISPLAY] = lap(&last);
+        swap_display(data);
+        t[STAGE_SWAP] = lap(&last);
+        update_input(data);
+    }
+
+    print_bench(data, times, frame);
+    free(times);
+    return 0;
+}
+
+// The texture width that has about a texel per pixel around the rim of the
+// globe, the longest circle on screen.  Everywhere else the texture is
+// minified, so anything wider is only ever seen through smaller mipmaps.
+static int target_width(sosg_p data)
+{
+    if (data->full_size) return 0;
+    return (int)ceil(2.0*M_PI*data->radius*(float)data->h);
+}
+
+static void report_startup(sosg_p data, sosg_frame_p frame)
+{
+    float ms = (double)(SDL_GetPerformanceCounter() - data->startup)*1000.0/
+               (double)SDL_GetPerformanceFrequency();
+
+    if (frame->preview) {
+        printf("Preview after %.1f ms\n", ms);
     } else {
-        data->rotation += data->drotation;
+        printf("First frame after %.1f ms\n", ms);
+        data->startup = 0;
     }
 }
 
@@ -461,10 +1561,23 @@ static void usage(sosg_p data)
     printf("        -v     Display a video or videos\n");
 #endif /* USE_SOSG_VIDEO */
     printf("        -p     Satellite tracking as a PREDICT client\n");
+    printf("        -P     Play images as a sequence at this many frames per second\n");
     printf("        -s     Optional string to overlay\n\n");
     printf("    Snow Globe Configuration\n");
     printf("        -f     Fullscreen\n");
     printf("        -m     Mirror horizontally\n");
+    printf("        -l     Use a precomputed lookup texture for the mapping\n");
+    printf("        -n     Use the naive 5 tap filter instead of mipmaps\n");
+    printf("        -c     Render on the CPU instead of with OpenGL\n");
+    printf("        -k     Compress images to DXT1 while loading them\n");
+    printf("        -S     Decode images at full size instead of the globe's resolution\n");
+    printf("        -C     Images to keep loaded around the current one (%d)\n", data->cache_frames);
+    printf("        -M     Most memory for loaded images in MB (%d)\n", data->cache_mb);
+    printf("        -B     Crossfade between images over this many seconds\n");
+    printf("        -H     Back frame buffers with huge pages\n");
+    printf("        -u     Report upload and render time per frame\n");
+    printf("        -F N   Cap the frame rate at N fps\n");
+    printf("        --bench N  Render N frames offscreen and print stage timings\n");
     printf("        -d     Display number to use (%d)\n", data->display);
     printf("        -w     Window width in pixels (%d)\n", data->w);
     printf("        -h     Window height in pixels (%d)\n", data->h);
@@ -483,6 +1596,30 @@ static void usage(sosg_p data)
 
 static void cleanup(sosg_p data)
 {
+    int i;
+
+    if (data->report && data->frames) {
+        printf("Presented %d frames at %d Hz, missed %d\n",
+            data->frames, data->refresh, data->missed);
+    }
+    if (data->report && data->fps > 0.0 && data->mode == SOSG_IMAGES) {
+        int dropped = 0, late = 0;
+        sosg_image_get_stats(data->source.images, &dropped, &late);
+        printf("Played at %.2f fps, dropped %d images, %d were late\n", data->fps, dropped, late);
+    }
+#ifdef USE_SOSG_VIDEO
+    if (data->report && data->mode == SOSG_VIDEO) {
+        int shown = 0, skipped = 0;
+        sosg_video_get_stats(data->source.video, &shown, &skipped);
+        printf("Showed %d video frames, skipped %d\n", shown, skipped);
+    }
+#endif /* USE_SOSG_VIDEO */
+    if (data->report && data->mode == SOSG_IMAGES) {
+        size_t used = 0, spare = 0;
+        sosg_image_get_memory(data->source.images, &used, &spare);
+        printf("Image buffers: %zu MB in use, %zu MB spare\n", used >> 20, spare >> 20);
+    }
+
     switch (data->mode) {
         case SOSG_IMAGES:
             sosg_image_destroy(data->source.images);
@@ -498,10 +1635,26 @@ static void cleanup(sosg_p data)
     }
     
     // Now we can delete the OpenGL texture and close down SDL
-    glDeleteTextures(1, &data->texture);
+    if (data->glcontext) {
+        if (data->fbo) glDeleteFramebuffers(1, &data->fbo);
+        if (data->fbo_color) glDeleteRenderbuffers(1, &data->fbo_color);
+        if (data->vao) glDeleteVertexArrays(1, &data->vao);
+        if (data->vbo) glDeleteBuffers(1, &data->vbo);
+        glDeleteBuffers(PBO_COUNT, data->pbo);
+        // VLC is stopped by now, so nothing writes to the mapping anymore
+        if (data->video_fence) glDeleteSync(data->video_fence);
+        if (data->video_pbo) glDeleteBuffers(1, &data->video_pbo);
+        for (i = 0; i < data->ring; i++) glDeleteTextures(1, &data->textures[i].id);
+        for (i = 0; i < 2; i++) glDeleteTextures(1, &data->chroma[i].id);
+        glDeleteTextures(1, &data->tiles);
+        if (data->lut_texture) glDeleteTextures(1, &data->lut_texture);
+        SDL_GL_DeleteContext(data->glcontext);
+    }
+    if (data->soft) sosg_soft_destroy(data->soft);
+    if (data->canvas) SDL_DestroyTexture(data->canvas);
+    if (data->renderer) SDL_DestroyRenderer(data->renderer);
     if (data->text) SDL_FreeSurface(data->text);
 
-    if (data->glcontext) SDL_GL_DeleteContext(data->glcontext);
     SDL_Quit();
 }
 
@@ -509,12 +1662,18 @@ int main(int argc, char *argv[])
 {
     int c;
     char *filename = NULL;
+    int ret = 0;
+    static struct option long_options[] = {
+        {"bench", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
     
     sosg_p data = calloc(1, sizeof(sosg_t));
     if (!data) {
         fprintf(stderr, "Error: Could not allocate data\n");
         return 1;
     }
+    data->startup = SDL_GetPerformanceCounter();
     
     // Defaults are for my Snow Globe (not the only Snow Globe anymore!)
     data->w = 848;
@@ -525,8 +1684,11 @@ int main(int argc, char *argv[])
     data->center[0] = 431.0/(float)data->w;
     data->center[1] = 210.0/(float)data->h;
     data->rotation = M_PI;
+    data->cache_frames = CACHE_FRAMES;
+    data->cache_mb = CACHE_MB;
     
-    while ((c = getopt(argc, argv, "ivpfma:d:s:w:h:g:r:x:y:o:t:")) != -1) {
+    while ((c = getopt_long(argc, argv, "ivpfmlnckSHuF:C:M:B:P:a:d:s:w:h:g:r:x:y:o:t:",
+                            long_options, NULL)) != -1) {
         switch (c) {
             case 'i':
                 data->mode = SOSG_IMAGES;
@@ -545,6 +1707,49 @@ int main(int argc, char *argv[])
             case 'm':
                 data->mirror = 1;
                 break;
+            case 'l':
+                data->lut = 1;
+                break;
+            case 'n':
+                data->naive = 1;
+                break;
+            case 'c':
+                data->cpu = 1;
+                break;
+            case 'k':
+                data->compress = 1;
+                break;
+            case 'P':
+                data->fps = atof(optarg);
+                break;
+            case 'S':
+                data->full_size = 1;
+                break;
+            case 'C':
+                data->cache_frames = atoi(optarg);
+                break;
+            case 'M':
+                data->cache_mb = atoi(optarg);
+                break;
+            case 'B':
+                data->fade = atof(optarg);
+                break;
+            case 'H':
+                data->huge = 1;
+                break;
+            case 'u':
+                data->report = 1;
+                break;
+            case 'F':
+                data->max_fps = atoi(optarg);
+                break;
+            case 'b':
+                data->bench = atoi(optarg);
+                if (data->bench < 1) {
+                    fprintf(stderr, "Error: --bench needs a number of frames\n");
+                    return 1;
+                }
+                break;
             case 'd':
                 data->display = atoi(optarg);
                 break;
@@ -594,43 +1799,95 @@ int main(int argc, char *argv[])
     // Pick the last non-option arg as the filename to use
     filename = argv[argc-1];
     
-    if (setup(data)) {
+    if (data->cpu && data->compress) {
+        fprintf(stderr, "Warning: The software renderer needs uncompressed images, ignoring -k\n");
+        data->compress = 0;
+    }
+    
+    if (setup_sdl(data)) {
         cleanup(data);
         return 1;
     }
     
+    // Start the sources first so they load in the background while the
+    // window and renderer are set up
     switch (data->mode) {
         case SOSG_IMAGES:
             // The remaining args are assumed to be filenames.  getopt
             // reorders the argv to put non option args at the end on all 
             // platforms I know of, but it is not the POSIX standard to do so.
-            data->source.images = sosg_image_init(argc-optind, argv+optind);
+            data->source.images = sosg_image_init(argc-optind, argv+optind, data->compress,
+                target_width(data), data->cache_frames, (size_t)data->cache_mb << 20,
+                data->huge);
+            if (!data->source.images) {
+                cleanup(data);
+                return 1;
+            }
+            if (data->fps > 0.0) sosg_image_set_fps(data->source.images, data->fps);
             sosg_image_get_resolution(data->source.images, data->texres);
             break;
 #ifdef USE_SOSG_VIDEO
         case SOSG_VIDEO:
-            data->source.video = sosg_video_init(argc-optind, argv+optind);
+            data->source.video = sosg_video_init(argc-optind, argv+optind, data->huge);
             sosg_video_get_resolution(data->source.video, data->texres);
             break;
 #endif /* USE_SOSG_VIDEO */
         case SOSG_PREDICT:
-            data->source.predict = sosg_predict_init(filename);
+            data->source.predict = sosg_predict_init(filename, data->huge);
             sosg_predict_get_resolution(data->source.predict, data->texres);
             break;
     }
     
-    if (load_shaders(data)) {
+    if (setup(data)) {
         cleanup(data);
         return 1;
     }
     
-    while (handle_events(data) != -1) {
-        update_media(data);
-        update_display(data);
-        update_timer(data);
-        update_input(data);
+    if (!data->cpu && load_shaders(data)) {
+        cleanup(data);
+        return 1;
+    }
+
+#ifdef USE_SOSG_VIDEO
+    // Text can only be drawn into 32 bit frames, so video comes as YUV for
+    // the shader to convert only without it
+    if (data->mode == SOSG_VIDEO && !data->cpu && !data->text) {
+        sosg_video_set_planar(data->source.video, data->max_texture);
+    }
+#endif /* USE_SOSG_VIDEO */
+    
+    // Start timing frames from here, after everything has loaded
+    setup_pacing(data);
+
+    if (data->bench) {
+        ret = run_bench(data);
+    } else {
+        data->dirty = 1;
+        while (handle_events(data) != -1) {
+            int prefetched = 0;
+            sosg_frame_p frame = update_media(data);
+            if (frame) {
+                load_texture(data, frame);
+                data->dirty = 1;
+                if (data->startup && data->report) report_startup(data, frame);
+            } else {
+                // Frames that don't upload anything of their own upload
+                // what may be shown next
+                prefetched = prefetch_texture(data);
+            }
+            // Only redraw when something changed since the last frame
+            if (data->dirty) {
+                update_display(data);
+                swap_display(data);
+                data->dirty = 0;
+                update_timer(data);
+            } else if (!prefetched) {
+                wait_for_change(data);
+            }
+            update_input(data);
+        }
     }
     
     cleanup(data);
-	return 0;
+	return ret;
 }
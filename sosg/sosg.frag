@@ -1,4 +1,26 @@
+#extension GL_ARB_shader_texture_lod : enable
+
+#ifdef SOSG_TILED
+uniform sampler2DArray tex;
+uniform vec2 tilegrid;
+uniform vec2 tilesize;
+uniform float tileborder;
+#else
 uniform sampler2D tex;
+#endif
+#ifdef SOSG_YUV
+// tex is then the luma of the video, and these its chroma at half resolution
+uniform sampler2D texu;
+uniform sampler2D texv;
+uniform mat3 yuv;
+#endif
+#ifdef SOSG_LUT
+uniform sampler2D lut;
+#endif
+#ifdef SOSG_CROSSFADE
+uniform sampler2D previous;
+uniform float fade; // from the previous image at 0 to tex at 1
+#endif
 uniform float radius;
 uniform float height;
 uniform float ratio;
@@ -6,15 +28,111 @@ uniform float rotation;
 uniform vec2 center;
 uniform vec2 texres;
 
+varying vec2 st;
+
 #define SIN_PI_4 0.7071067811865475
 #define PI2 6.283185307179586
 #define PI 3.141592653589793
 #define PI_2 1.5707963267948966
 
+#ifdef SOSG_TILED
+// Sample with the footprint given by the derivatives of the mapping
+vec4 sample_footprint(vec2 fisheye, vec2 gradx, vec2 grady)
+{
+    // Wrap around in longitude, then find the tile and the position in its
+    // layer, which has a border of the neighboring texels all around
+    vec2 texsize = 1.0/texres;
+    vec2 layersize = tilesize + 2.0*tileborder;
+    vec2 texel = vec2(fract(fisheye.x), clamp(fisheye.y, 0.0, 1.0))*texsize;
+    vec2 tile = min(floor(texel/tilesize), tilegrid - 1.0);
+    vec2 local = (texel - tile*tilesize + tileborder)/layersize;
+    vec2 scale = texsize/layersize;
+    return textureGrad(tex, vec3(local, tile.y*tilegrid.x + tile.x),
+                       gradx*scale, grady*scale);
+}
+
+vec4 sample_flat(vec2 fisheye)
+{
+    return sample_footprint(fisheye, vec2(0.0), vec2(0.0));
+}
+#else
+vec4 sample_grad(sampler2D t, vec2 fisheye, vec2 gradx, vec2 grady)
+{
+#ifdef GL_ARB_shader_texture_lod
+    return texture2DGradARB(t, fisheye, gradx, grady);
+#else
+    // Bias the implicit level of detail over to the one we want
+    vec2 texsize = 1.0/texres;
+    float lod = log2(max(length(gradx*texsize), length(grady*texsize)));
+    float implicit = log2(max(length(dFdx(fisheye)*texsize), length(dFdy(fisheye)*texsize)));
+    return texture2D(t, fisheye, lod - implicit);
+#endif
+}
+
+#ifdef SOSG_YUV
+// Filtering is linear, so the planes can be sampled on their own and
+// converted afterwards, from video range
+vec4 to_rgb(float y, float u, float v)
+{
+    return vec4(yuv*(vec3(y, u, v) - vec3(16.0, 128.0, 128.0)/255.0), 1.0);
+}
+#endif
+
+// Sample with the footprint given by the derivatives of the mapping
+vec4 sample_footprint(vec2 fisheye, vec2 gradx, vec2 grady)
+{
+#ifdef SOSG_YUV
+    return to_rgb(sample_grad(tex, fisheye, gradx, grady).r,
+                  sample_grad(texu, fisheye, gradx, grady).r,
+                  sample_grad(texv, fisheye, gradx, grady).r);
+#else
+    return sample_grad(tex, fisheye, gradx, grady);
+#endif
+}
+
+vec4 sample_flat(vec2 fisheye)
+{
+#ifdef SOSG_YUV
+    return to_rgb(texture2D(tex, fisheye).r, texture2D(texu, fisheye).r,
+                  texture2D(texv, fisheye).r);
+#else
+    return texture2D(tex, fisheye);
+#endif
+}
+#endif
+
+#ifdef SOSG_CROSSFADE
+vec4 sample_previous(vec2 fisheye, vec2 gradx, vec2 grady)
+{
+#ifdef GL_ARB_shader_texture_lod
+    return texture2DGradARB(previous, fisheye, gradx, grady);
+#else
+    // It's only seen for the length of the fade, so the seam where the
+    // implicit level of detail jumps doesn't matter much
+    return texture2D(previous, fisheye);
+#endif
+}
+#endif
+
 void main(void)
 {
     vec4 color = vec4(0.0);
-    vec2 offset = (gl_TexCoord[0].st - center)*vec2(ratio, 1.0);
+#ifdef SOSG_LUT
+    // The mapping without rotation was baked into the lookup texture
+    vec3 mapping = texture2D(lut, st).xyz;
+    // The mapping wraps around in longitude, so take the short way around
+    vec2 gradx = dFdx(mapping.xy);
+    vec2 grady = dFdy(mapping.xy);
+    gradx.x -= floor(gradx.x + 0.5);
+    grady.x -= floor(grady.x + 0.5);
+    if (mapping.z < 0.5) {
+        gl_FragColor = color;
+    } else {
+        vec2 fisheye = vec2(mapping.x + rotation/PI2, mapping.y);
+#else
+    vec2 offset = (st - center)*vec2(ratio, 1.0);
+    vec2 offsetx = dFdx(offset);
+    vec2 offsety = dFdy(offset);
     float d = length(offset);
     if (d > radius) {
         gl_FragColor = color;
@@ -24,14 +142,31 @@ void main(void)
         float theta = asin(height*h)+asin(h);
         float phi = atan(offset[0],offset[1]);
         vec2 fisheye = vec2((rotation-phi)/PI2, theta/PI_2);
+
+        // Chain the analytic derivatives of the mapping with the screen space
+        // derivatives of the offset, which avoids the seam where phi wraps
+        d = max(d, 1e-6);
+        vec2 dphi = vec2(offset[1], -offset[0])/(d*d);
+        vec2 dtheta = (SIN_PI_4/radius)*(height/sqrt(1.0-height*height*h*h)
+                      + 1.0/sqrt(1.0-h*h))*offset/d;
+        vec2 gradx = vec2(-dot(dphi, offsetx)/PI2, dot(dtheta, offsetx)/PI_2);
+        vec2 grady = vec2(-dot(dphi, offsety)/PI2, dot(dtheta, offsety)/PI_2);
+#endif
         
+#ifdef SOSG_NAIVE_FILTER
         // A really naive filter to reduce sparkling
-        color += texture2D(tex, fisheye + vec2(-texres[0], 0.0));
-        color += texture2D(tex, fisheye + vec2(texres[0], 0.0));
-        color += texture2D(tex, fisheye + vec2(0.0, texres[1]));
-        color += texture2D(tex, fisheye + vec2(0.0, -texres[1]));
+        color += sample_flat(fisheye + vec2(-texres[0], 0.0));
+        color += sample_flat(fisheye + vec2(texres[0], 0.0));
+        color += sample_flat(fisheye + vec2(0.0, texres[1]));
+        color += sample_flat(fisheye + vec2(0.0, -texres[1]));
         color /= 8.0;
-        color += texture2D(tex, fisheye)*0.5;
+        color += sample_flat(fisheye)*0.5;
+#else
+        color = sample_footprint(fisheye, gradx, grady);
+#endif
+#ifdef SOSG_CROSSFADE
+        if (fade < 1.0) color = mix(sample_previous(fisheye, gradx, grady), color, fade);
+#endif
 	    gl_FragColor = color;
 	}
 }
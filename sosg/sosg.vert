@@ -1,5 +1,13 @@
+// GLSL 1.10, so it still runs on OpenGL 2.1, but without the fixed function
+// inputs.  The disc comes in as generic attributes that are already in
+// normalized device coordinates.
+attribute vec2 position;
+attribute vec2 texcoord;
+
+varying vec2 st;
+
 void main(void)
 {
-	gl_TexCoord[0] = gl_MultiTexCoord0;
-    gl_Position = ftransform();
+    st = texcoord;
+    gl_Position = vec4(position, 0.0, 1.0);
 }
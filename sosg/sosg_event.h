@@ -0,0 +1,18 @@
+#ifndef _SOSG_EVENT_H_
+#define _SOSG_EVENT_H_
+
+#include "SDL.h"
+
+// Sources running in their own threads post this when they have something
+// new to show, so that an idle main loop wakes up to check on them
+#define SOSG_EVENT_WAKE SDL_USEREVENT
+
+static inline void sosg_event_wake(void)
+{
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = SOSG_EVENT_WAKE;
+    SDL_PushEvent(&event);
+}
+
+#endif /* _SOSG_EVENT_H_ */
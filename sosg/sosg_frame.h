@@ -0,0 +1,35 @@
+#ifndef _SOSG_FRAME_H_
+#define _SOSG_FRAME_H_
+
+#include "SDL.h"
+
+#define SOSG_FRAME_MAX_LEVELS 16
+
+enum sosg_frame_format {
+    SOSG_FRAME_BGRA,       // 32 bit pixels in surface
+    SOSG_FRAME_COMPRESSED, // GPU compressed blocks in data
+    SOSG_FRAME_I420        // 8 bit Y, U and V planes in data, U and V at half size
+};
+
+// A frame handed from a source to the main loop to be shown
+typedef struct sosg_frame_struct {
+    int format;
+    int w;
+    int h;
+    int preview; // a stand in at low resolution until the real frame is ready
+    int readonly; // in memory that can't be drawn into, like a pack's map
+    int overlaid; // the text has been drawn into it already
+    uint64_t pts; // when it's meant to be on screen, as a performance counter, or 0
+    SDL_Surface *surface;
+
+    // Compressed frames keep every mip level back to back in data, and
+    // planar frames every plane
+    uint32_t internal; // OpenGL internal format of the blocks
+    int levels;
+    int sizes[SOSG_FRAME_MAX_LEVELS];
+    int pitches[3]; // bytes per row of each plane
+    uint8_t *data;
+    struct sosg_pool_struct *pool; // that data came from, or NULL if malloc'd
+} sosg_frame_t, *sosg_frame_p;
+
+#endif /* _SOSG_FRAME_H_ */
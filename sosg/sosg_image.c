@@ -18,87 +18,816 @@ Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
 */
 
 #include "sosg_image.h"
+#include "sosg_event.h"
+#include "sosg_ktx.h"
+#include "sosg_pack.h"
+#include "sosg_playlist.h"
+#include "sosg_pool.h"
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 
-#define PRELOAD_IMAGES 5
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif /* __SSE2__ */
+
+#ifdef USE_TURBOJPEG
+    #include <turbojpeg.h>
+#endif /* USE_TURBOJPEG */
+
+#define BEHIND_WEIGHT 2 // images behind the direction of travel matter less
+#define MAX_LOADERS 16
+#define MIN_SCALE 0.75 // of the target width, to land on 2048 from 4096 or 8192
+#define PREVIEW_SCALE 8 // times smaller than the target width
+#define EXIF_SEARCH 65536 // bytes at the start of a JPEG to look for a thumbnail in
+#define PROBE_LIMIT 64 // images to check for a valid one to start on
+#define MAX_POOLS 4 // sizes of frame buffer, enough for decoded, scaled and compressed
+#define POOL_SPARE 4 // free buffers kept per size of frame that is kept around
+
+enum img_state {
+    IMG_EMPTY,
+    IMG_LOADING,
+    IMG_LOADED,
+    IMG_FAILED
+};
 
 typedef struct img_struct {
-    char *path;
-    SDL_Surface *buffer;
+    sosg_frame_t frame;
+    size_t size;
+    int state;
 } img_t, *img_p;
 
+// Only a window of decoded frames around the current index is kept, since a
+// whole SOS dataset doesn't fit in memory.  A pool of loader threads keeps
+// running to refill the window as the index moves, and everything in here
+// past the paths and resolution is protected by mutex.
 typedef struct sosg_image_struct {
+    sosg_playlist_p playlist;
     int num_images;
+    int resolution[2];
     int num_loaded;
     int index;
     int last_index;
+    int direction;
+    int shown;
+    int pinned; // peeked at to be uploaded ahead of time
+
+    // Playback of image sequences, advancing base by the clock
+    float fps;
+    int base;
+    uint64_t play_start;
+    int late_index;
+    int seeked;
+    float decode_time; // seconds, a running average
+    int dropped;
+    int late;
+
     int updated;
     int running;
-    SDL_Thread *load_thread;
-    img_p *images;
+    int compress;
+    int target_width;
+    SDL_atomic_t max_size; // the largest texture, if bigger ones can't be shown
+    int want_preview;
+    int preview_index;
+    int has_preview;
+    sosg_frame_t preview;
+    int window;
+    size_t budget;
+    size_t bytes;
+    size_t pending;
+    size_t largest;
+    sosg_pack_p pack;
+    int huge;
+    int num_pools;
+    sosg_pool_p pools[MAX_POOLS];
+    SDL_mutex *mutex;
+    SDL_cond *changed;
+    int num_loaders;
+    SDL_Thread *loaders[MAX_LOADERS];
+    img_t *images;
 } sosg_image_t;
 
-static void load_image(img_p img)
+static int has_extension(const char *path, const char *extension)
+{
+    const char *ext = strrchr(path, '.');
+    return ext && !strcasecmp(ext, extension);
+}
+
+// The pool for blocks of exactly size bytes.  The frames in a dataset are
+// almost always the same size, so the same few blocks get passed around as
+// images come and go instead of fragmenting the heap.  spare is only used if
+// this creates the pool.
+static sosg_pool_p get_pool(sosg_image_p images, size_t size, int spare)
+{
+    int i;
+    sosg_pool_p pool = NULL;
+
+    SDL_LockMutex(images->mutex);
+    for (i = 0; i < images->num_pools; i++) {
+        if (sosg_pool_get_block_size(images->pools[i]) == size) pool = images->pools[i];
+    }
+    if (!pool && images->num_pools < MAX_POOLS) {
+        pool = sosg_pool_init(size, spare, images->huge);
+        if (pool) images->pools[images->num_pools++] = pool;
+    }
+    SDL_UnlockMutex(images->mutex);
+
+    // Past that, the sizes are all over the place and a pool wouldn't help
+    return pool;
+}
+
+// Free with sosg_pool_free_surface, which works for either kind
+static SDL_Surface *create_buffer(sosg_image_p images, int w, int h, int spare)
+{
+    SDL_Surface *buffer = NULL;
+
+    if (images) buffer = sosg_pool_create_surface(get_pool(images, (size_t)w*h*4, spare), w, h);
+    if (!buffer) {
+        buffer = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32,
+            0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    }
+    return buffer;
+}
+
+#ifdef USE_TURBOJPEG
+// The smallest scale the DCT can do that is still about as wide as the target
+static tjscalingfactor jpeg_scale(int w, int target_width)
+{
+    int i, num_factors;
+    tjscalingfactor *factors = tjGetScalingFactors(&num_factors);
+    tjscalingfactor best = {1, 1};
+
+    for (i = 0; target_width && factors && i < num_factors; i++) {
+        int scaled = TJSCALED(w, factors[i]);
+        if (scaled >= MIN_SCALE*target_width && scaled < TJSCALED(w, best)) {
+            best = factors[i];
+        }
+    }
+
+    return best;
+}
+
+// Let the DCT do most of the scaling, which is far cheaper than decoding at
+// full size and scaling afterwards.  Returns NULL to fall back on SDL_image.
+static SDL_Surface *decode_jpeg(sosg_image_p images, const char *path, int target_width)
+{
+    int w, h, subsamp, colorspace;
+    SDL_Surface *buffer = NULL;
+    uint8_t *jpeg = NULL;
+    long size = 0;
+
+    FILE *file = fopen(path, "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        jpeg = malloc(size);
+        if (jpeg && fread(jpeg, size, 1, file) != 1) {
+            free(jpeg);
+            jpeg = NULL;
+        }
+        fclose(file);
+    }
+    if (!jpeg) return NULL;
+
+    tjhandle handle = tjInitDecompress();
+    if (handle && !tjDecompressHeader3(handle, jpeg, size, &w, &h, &subsamp, &colorspace)) {
+        tjscalingfactor best = jpeg_scale(w, target_width);
+
+        // TJPF_BGRA is the same byte order as our ARGB surfaces
+        buffer = create_buffer(images, TJSCALED(w, best), TJSCALED(h, best), POOL_SPARE);
+        if (buffer && tjDecompress2(handle, jpeg, size, buffer->pixels, buffer->w,
+                                    buffer->pitch, buffer->h, TJPF_BGRA, 0)) {
+            sosg_pool_free_surface(buffer);
+            buffer = NULL;
+        }
+    }
+
+    if (handle) tjDestroy(handle);
+    free(jpeg);
+    return buffer;
+}
+#endif /* USE_TURBOJPEG */
+
+// Average every k by k block of texels into one
+static SDL_Surface *downsample(sosg_image_p images, SDL_Surface *surface, int k)
+{
+    int x, y, i, j;
+    SDL_Surface *buffer = create_buffer(images, surface->w/k, surface->h/k, POOL_SPARE);
+    if (!buffer) return NULL;
+
+    const uint8_t *src = surface->pixels;
+    for (y = 0; y < buffer->h; y++) {
+        uint32_t *out = (uint32_t *)((uint8_t *)buffer->pixels + y*buffer->pitch);
+        for (x = 0; x < buffer->w; x++) {
+#ifdef __SSE2__
+            __m128i zero = _mm_setzero_si128();
+            __m128i sum = zero;
+            for (j = 0; j < k; j++) {
+                const uint32_t *row = (const uint32_t *)(src + (y*k + j)*surface->pitch) + x*k;
+                for (i = 0; i < k; i++) {
+                    __m128i texel = _mm_unpacklo_epi8(_mm_cvtsi32_si128(row[i]), zero);
+                    sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(texel, zero));
+                }
+            }
+            __m128 mean = _mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(1.0/(float)(k*k)));
+            __m128i texel = _mm_cvtps_epi32(mean);
+            texel = _mm_packs_epi32(texel, texel);
+            out[x] = _mm_cvtsi128_si32(_mm_packus_epi16(texel, texel));
+#else
+            int c;
+            int sum[4] = {0, 0, 0, 0};
+            for (j = 0; j < k; j++) {
+                const uint8_t *row = src + (y*k + j)*surface->pitch + x*k*4;
+                for (i = 0; i < k*4; i++) sum[i & 3] += row[i];
+            }
+            for (c = 0; c < 4; c++) {
+                ((uint8_t *)&out[x])[c] = (sum[c] + k*k/2)/(k*k);
+            }
+#endif /* __SSE2__ */
+        }
+    }
+
+    return buffer;
+}
+
+// There's no point keeping more texels than the globe has pixels, and none
+// in keeping more than the GPU can take
+static int box_scale(sosg_image_p images, int w, int h)
+{
+    int k = images->target_width ? w/SDL_max(1, (int)(MIN_SCALE*images->target_width)) : 1;
+    int max_size = SDL_AtomicGet(&images->max_size);
+    if (max_size) k = SDL_max(k, (SDL_max(w, h) + max_size - 1)/max_size);
+    return k;
+}
+
+// Decode into frame without touching the shared state, so it can be done
+// outside the lock
+static int load_image(sosg_image_p images, const char *path, int compress,
+                      sosg_frame_p frame)
 {
-    SDL_Surface *surface = IMG_Load(img->path);
-    if (surface) {
-        // We blit to a new buffer to ensure the color order and depth are correct
-        img->buffer = SDL_CreateRGBSurface(SDL_SWSURFACE, 
-            surface->w, surface->h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-        SDL_BlitSurface(surface, NULL, img->buffer, NULL);
+    memset(frame, 0, sizeof(sosg_frame_t));
+
+    // Already compressed offline, so just read the blocks in
+    if (has_extension(path, ".ktx")) return sosg_ktx_load(path, frame);
+
+    SDL_Surface *buffer = NULL;
+#ifdef USE_TURBOJPEG
+    if (has_extension(path, ".jpg") || has_extension(path, ".jpeg")) {
+        buffer = decode_jpeg(images, path, images->target_width);
+    }
+#endif /* USE_TURBOJPEG */
+
+    if (!buffer) {
+        SDL_Surface *surface = IMG_Load(path);
+        if (!surface) {
+            fprintf(stderr, "Warning: Could not load %s: %s\n", path, IMG_GetError());
+            return -1;
+        }
+
+        // We blit to a new buffer to ensure the color order and depth are correct.
+        // When that is only going to be scaled or compressed, spares of it
+        // would be whole 8k frames sitting outside the budget, so keep just
+        // the one the loaders take turns with.
+        int spare = compress || box_scale(images, surface->w, surface->h) > 1 ? 1 : POOL_SPARE;
+        buffer = create_buffer(images, surface->w, surface->h, spare);
+        if (buffer) SDL_BlitSurface(surface, NULL, buffer, NULL);
         SDL_FreeSurface(surface);
+        if (!buffer) return -1;
+    }
+
+    int k = box_scale(images, buffer->w, buffer->h);
+    if (k > 1) {
+        SDL_Surface *scaled = downsample(images, buffer, k);
+        if (scaled) {
+            sosg_pool_free_surface(buffer);
+            buffer = scaled;
+        }
+    }
+
+    if (compress) {
+        // Only the compressed blocks are kept around
+        size_t size = sosg_ktx_layout(frame, buffer->w, buffer->h);
+        frame->pool = get_pool(images, size, POOL_SPARE);
+        frame->data = sosg_pool_alloc(frame->pool);
+        if (!frame->data) {
+            frame->pool = NULL;
+            frame->data = malloc(size);
+        }
+        if (frame->data) sosg_ktx_encode_into(buffer, frame);
+        sosg_pool_free_surface(buffer);
+        return frame->data ? 0 : -1;
+    }
+
+    frame->format = SOSG_FRAME_BGRA;
+    frame->w = buffer->w;
+    frame->h = buffer->h;
+    frame->surface = buffer;
+    return 0;
+}
+
+static inline uint32_t read_exif(const uint8_t *p, int big_endian, int bytes)
+{
+    if (bytes == 2) return big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+    return big_endian ? ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+                      : p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Whether the bytes at offset are within the TIFF data.  Offsets come from
+// the file, so this is done in 64 bits where adding them up can't wrap around.
+static inline int exif_fits(uint64_t offset, uint64_t bytes, int tiff_size)
+{
+    return offset + bytes <= (uint64_t)tiff_size;
+}
+
+// Find the thumbnail cameras and most editors embed in the EXIF data of a
+// JPEG, which is the second IFD of the TIFF structure in the APP1 segment
+static SDL_Surface *load_thumbnail(const uint8_t *jpeg, int size)
+{
+    int i, pos = 2;
+
+    if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return NULL;
+
+    while (pos + 4 <= size && jpeg[pos] == 0xFF) {
+        int marker = jpeg[pos+1];
+        int length = (jpeg[pos+2] << 8) | jpeg[pos+3];
+        // The EXIF segment always comes before the image data
+        if (marker == 0xDA) break;
+        if (marker == 0xE1 && pos + 4 + length - 2 <= size && length > 16 &&
+            !memcmp(jpeg + pos + 4, "Exif\0\0", 6)) {
+            const uint8_t *tiff = jpeg + pos + 10;
+            int tiff_size = length - 8;
+            int big_endian = tiff[0] == 'M';
+            uint64_t ifd = read_exif(tiff + 4, big_endian, 4);
+            if (!exif_fits(ifd, 2, tiff_size)) return NULL;
+
+            // Skip over IFD0 to IFD1, which describes the thumbnail
+            uint64_t next = ifd + 2 + 12*(uint64_t)read_exif(tiff + ifd, big_endian, 2);
+            if (!exif_fits(next, 4, tiff_size)) return NULL;
+            ifd = read_exif(tiff + next, big_endian, 4);
+            if (!ifd || !exif_fits(ifd, 2, tiff_size)) return NULL;
+
+            uint64_t offset = 0, thumb_size = 0;
+            int entries = read_exif(tiff + ifd, big_endian, 2);
+            for (i = 0; i < entries && exif_fits(ifd + 2 + 12*(uint64_t)i, 12, tiff_size); i++) {
+                const uint8_t *entry = tiff + ifd + 2 + 12*i;
+                int tag = read_exif(entry, big_endian, 2);
+                if (tag == 0x0201) offset = read_exif(entry + 8, big_endian, 4);
+                if (tag == 0x0202) thumb_size = read_exif(entry + 8, big_endian, 4);
+            }
+            if (!offset || !thumb_size || !exif_fits(offset, thumb_size, tiff_size)) return NULL;
+            return IMG_Load_RW(SDL_RWFromConstMem(tiff + offset, thumb_size), 1);
+        }
+        pos += 2 + length;
+    }
+
+    return NULL;
+}
+
+// A quick low resolution version of an image to show while the first one is
+// loading, either the embedded thumbnail or a heavily scaled decode
+static int load_preview(sosg_image_p images, const char *path, sosg_frame_p frame)
+{
+    SDL_Surface *surface = NULL;
+    uint8_t *head = malloc(EXIF_SEARCH);
+
+    FILE *file = fopen(path, "rb");
+    if (file && head) {
+        int size = fread(head, 1, EXIF_SEARCH, file);
+        surface = load_thumbnail(head, size);
+    }
+    if (file) fclose(file);
+    free(head);
+
+#ifdef USE_TURBOJPEG
+    if (!surface && (has_extension(path, ".jpg") || has_extension(path, ".jpeg"))) {
+        surface = decode_jpeg(NULL, path, SDL_max(1, images->target_width/PREVIEW_SCALE));
+    }
+#endif /* USE_TURBOJPEG */
+    if (!surface) return -1;
+
+    memset(frame, 0, sizeof(sosg_frame_t));
+    frame->format = SOSG_FRAME_BGRA;
+    frame->w = surface->w;
+    frame->h = surface->h;
+    frame->preview = 1;
+    // Only made once, so it isn't worth a pool
+    frame->surface = create_buffer(NULL, surface->w, surface->h, 0);
+    if (frame->surface) SDL_BlitSurface(surface, NULL, frame->surface, NULL);
+    SDL_FreeSurface(surface);
+    return frame->surface ? 0 : -1;
+}
+
+// The size of a JPEG is in its start of frame segment, which comes after the
+// EXIF and other metadata segments
+static int probe_jpeg(FILE *file, int *w, int *h)
+{
+    uint8_t segment[8];
+
+    while (fread(segment, 4, 1, file) == 1 && segment[0] == 0xFF) {
+        int marker = segment[1];
+        int length = (segment[2] << 8) | segment[3];
+        // Any SOF other than DHT, JPG and DAC
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+            marker != 0xC8 && marker != 0xCC) {
+            if (fread(segment, 5, 1, file) != 1) return -1;
+            *h = (segment[1] << 8) | segment[2];
+            *w = (segment[3] << 8) | segment[4];
+            return *w && *h ? 0 : -1;
+        }
+        if (marker == 0xDA || length < 2 || fseek(file, length - 2, SEEK_CUR)) break;
+    }
+
+    return -1;
+}
+
+// Get the size of an image from just its header.  Returns 0 with the size, -1
+// if it can't be read or is broken, or 1 if it's in a format that has to be
+// decoded to find out.
+static int probe_image(const char *path, int *w, int *h)
+{
+    uint8_t head[24];
+    int ret = 1;
+
+    if (has_extension(path, ".ktx")) return sosg_ktx_probe(path, w, h);
+
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+
+    if (fread(head, sizeof(head), 1, file) != 1) {
+        ret = -1;
+    } else if (head[0] == 0xFF && head[1] == 0xD8) {
+        fseek(file, 2, SEEK_SET);
+        ret = probe_jpeg(file, w, h);
+    } else if (!memcmp(head, "\x89PNG\r\n\x1A\n", 8) && !memcmp(head + 12, "IHDR", 4)) {
+        *w = read_exif(head + 16, 1, 4);
+        *h = read_exif(head + 20, 1, 4);
+        ret = *w > 0 && *h > 0 ? 0 : -1;
+    } else if (has_extension(path, ".png") || has_extension(path, ".jpg") ||
+               has_extension(path, ".jpeg")) {
+        ret = -1;
+    }
+    fclose(file);
+
+    return ret;
+}
+
+// The size an image will be once it's decoded and scaled to the target
+static void decoded_size(sosg_image_p images, const char *path, int *w, int *h)
+{
+    if (has_extension(path, ".ktx")) return;
+#ifdef USE_TURBOJPEG
+    if (has_extension(path, ".jpg") || has_extension(path, ".jpeg")) {
+        tjscalingfactor scale = jpeg_scale(*w, images->target_width);
+        *w = TJSCALED(*w, scale);
+        *h = TJSCALED(*h, scale);
+    }
+#endif /* USE_TURBOJPEG */
+    int k = box_scale(images, *w, *h);
+    if (k > 1) {
+        *w /= k;
+        *h /= k;
+    }
+}
+
+static size_t frame_size(sosg_frame_p frame)
+{
+    int i;
+    size_t size = 0;
+
+    if (frame->surface) return (size_t)frame->surface->pitch*frame->surface->h;
+    for (i = 0; i < frame->levels; i++) size += frame->sizes[i];
+    return size;
+}
+
+static void free_frame(sosg_frame_p frame)
+{
+    if (frame->surface) sosg_pool_free_surface(frame->surface);
+    frame->surface = NULL;
+    if (frame->pool) {
+        sosg_pool_free(frame->pool, frame->data);
+        frame->data = NULL;
+        frame->pool = NULL;
+    }
+    sosg_ktx_free(frame);
+}
+
+// How many images away from the current index i is, in either direction
+static int distance(sosg_image_p images, int i)
+{
+    int d = (i - images->index + images->num_images) % images->num_images;
+    return SDL_min(d, images->num_images - d);
+}
+
+// How many images ahead of the current index i is in the direction the user
+// is moving in, wrapping around
+static int ahead(sosg_image_p images, int i)
+{
+    int d = (i - images->index + images->num_images) % images->num_images;
+    return images->direction < 0 ? (images->num_images - d) % images->num_images : d;
+}
+
+// The window is centered on the current index, except during playback where
+// only the images coming up next matter
+static int in_window(sosg_image_p images, int i)
+{
+    if (images->fps > 0.0) return ahead(images, i) < images->window;
+    return distance(images, i) <= images->window/2;
+}
+
+// The distance weighted towards the direction the user is moving in, so
+// images ahead get loaded first and the ones behind get dropped first
+static int cost(sosg_image_p images, int i)
+{
+    int d = ahead(images, i);
+    if (images->fps > 0.0) return d;
+    return SDL_min(d, BEHIND_WEIGHT*(images->num_images - d));
+}
+
+static void evict(sosg_image_p images, int i)
+{
+    img_p img = &images->images[i];
+    images->bytes -= img->size;
+    images->num_loaded--;
+    free_frame(&img->frame);
+    img->size = 0;
+    img->state = IMG_EMPTY;
+}
+
+// The loaded image farthest from the current index that can be dropped, or
+// -1 if there are none.  The image last passed to the renderer stays, since
+// the software renderer keeps drawing from it, and so does the one last
+// peeked at.
+static int farthest(sosg_image_p images)
+{
+    int i;
+    int far = -1;
+    for (i = 0; i < images->num_images; i++) {
+        if (images->images[i].state != IMG_LOADED || i == images->shown ||
+            i == images->pinned) continue;
+        if (far < 0 || cost(images, i) > cost(images, far)) far = i;
+    }
+    return far;
+}
+
+// The cheapest image in the window still to be loaded, or -1 if it's full
+static int next_to_load(sosg_image_p images)
+{
+    int c, i = 0;
+    int half = images->window/2;
+    int step = images->direction < 0 ? -1 : 1;
+    int n = images->num_images;
+
+    if (images->fps > 0.0) {
+        // Read ahead of the playhead in order, skipping the images that
+        // couldn't be decoded before the playhead gets to them anyway
+        int last = SDL_min(images->window, n);
+        int first = images->play_start ? (int)ceil(images->decode_time*images->fps) : 0;
+        for (c = SDL_min(first, last - 1); c < last; c++) {
+            i = (images->index + c) % n;
+            if (images->images[i].state == IMG_EMPTY) break;
+        }
+        if (c == last) return -1;
+    } else {
+        // Walk outwards in order of cost, checking ahead at every step and
+        // behind at every BEHIND_WEIGHT steps
+        for (c = 0; c <= BEHIND_WEIGHT*half; c++) {
+            if (c <= half) {
+                i = ((images->index + step*c) % n + n) % n;
+                if (images->images[i].state == IMG_EMPTY) break;
+            }
+            if (c && c % BEHIND_WEIGHT == 0) {
+                i = ((images->index - step*c/BEHIND_WEIGHT) % n + n) % n;
+                if (images->images[i].state == IMG_EMPTY) break;
+            }
+        }
+        if (c > BEHIND_WEIGHT*half) return -1;
     }
+
+    // Don't load anything that would have to push out something nearer,
+    // counting what the other loaders are still decoding
+    if (images->budget && images->bytes + images->pending + images->largest > images->budget) {
+        int far = farthest(images);
+        if (far < 0 || cost(images, far) <= cost(images, i)) return -1;
+    }
+    return i;
+}
+
+static int open_pack(sosg_image_p images, const char *path)
+{
+    int i;
+
+    images->pack = sosg_pack_open(path);
+    if (!images->pack) return -1;
+
+    images->num_images = sosg_pack_get_count(images->pack);
+    images->images = calloc(images->num_images, sizeof(img_t));
+    if (!images->images) return -1;
+    for (i = 0; i < images->num_images; i++) {
+        if (sosg_pack_get_frame(images->pack, i, &images->images[i].frame)) {
+            images->images[i].state = IMG_FAILED;
+            continue;
+        }
+        images->images[i].state = IMG_LOADED;
+        images->num_loaded++;
+    }
+    if (images->num_images) {
+        images->resolution[0] = images->images[0].frame.w;
+        images->resolution[1] = images->images[0].frame.h;
+    }
+
+    return 0;
 }
 
-// TODO: keep the thread running and free images far from the current index
-//       to allow loading giant data sets
 static int sosg_image_load(void *data)
 {
     sosg_image_p images = (sosg_image_p)data;
+    sosg_frame_t frame;
     int i;
-    
-    // Load all of the remaining images
-    for (i = PRELOAD_IMAGES; i < images->num_images; i++) {
-        // Stop early if we're exiting
-        if (!images->running) break;
-        load_image(images->images[i]);
+
+    SDL_LockMutex(images->mutex);
+    while (images->running) {
+        // Whichever loader gets here first makes a preview of the first image
+        // while the others start on the real thing
+        if (images->want_preview) {
+            images->want_preview = 0;
+            int index = images->index;
+            const char *path = sosg_playlist_get_path(images->playlist, index);
+
+            SDL_UnlockMutex(images->mutex);
+            int ret = load_preview(images, path, &frame);
+            SDL_LockMutex(images->mutex);
+
+            // It's no use if the real image beat it
+            if (!ret && images->images[index].state != IMG_LOADED) {
+                images->preview = frame;
+                images->preview_index = index;
+                images->has_preview = 1;
+                sosg_event_wake();
+            } else if (!ret) {
+                free_frame(&frame);
+            }
+            continue;
+        }
+
+        // Drop whatever fell out of the window since the index moved
+        for (i = 0; i < images->num_images; i++) {
+            if (images->images[i].state == IMG_LOADED && i != images->shown &&
+                i != images->pinned && !in_window(images, i)) {
+                evict(images, i);
+            }
+        }
+
+        int next = next_to_load(images);
+        if (next < 0) {
+            // Sleep until the index moves
+            SDL_CondWait(images->changed, images->mutex);
+            continue;
+        }
+
+        img_p img = &images->images[next];
+        img->state = IMG_LOADING;
+        size_t reserved = images->largest;
+        images->pending += reserved;
+        int compress = images->compress;
+        int max_size = SDL_AtomicGet(&images->max_size);
+
+        uint64_t start = SDL_GetPerformanceCounter();
+        SDL_UnlockMutex(images->mutex);
+        int ret = load_image(images, sosg_playlist_get_path(images->playlist, next),
+                             compress, &frame);
+        SDL_LockMutex(images->mutex);
+
+        float seconds = (double)(SDL_GetPerformanceCounter() - start)/
+                        (double)SDL_GetPerformanceFrequency();
+        images->decode_time = images->decode_time ? 0.9*images->decode_time + 0.1*seconds : seconds;
+
+        images->pending -= reserved;
+        if (ret) {
+            img->state = IMG_FAILED;
+            continue;
+        }
+
+        // Throw the image away if the index moved on while decoding it, or
+        // compression got turned off, or it was scaled for the wrong size
+        if (!in_window(images, next) || compress != images->compress ||
+            max_size != SDL_AtomicGet(&images->max_size)) {
+            free_frame(&frame);
+            img->state = IMG_EMPTY;
+            continue;
+        }
+
+        size_t size = frame_size(&frame);
+        if (size > images->largest) images->largest = size;
+
+        // Make room in the budget, keeping the new image over farther ones
+        while (images->budget && images->bytes + size > images->budget) {
+            int far = farthest(images);
+            if (far < 0 || cost(images, far) <= cost(images, next)) break;
+            evict(images, far);
+        }
+
+        img->frame = frame;
+        img->size = size;
+        img->state = IMG_LOADED;
+        images->bytes += size;
         images->num_loaded++;
+
+        // The current image may have just become available
+        if (next == images->index) sosg_event_wake();
     }
+    SDL_UnlockMutex(images->mutex);
     
     return 0;
 }
 
-sosg_image_p sosg_image_init(int num_paths, char *paths[])
+sosg_image_p sosg_image_init(int num_paths, char *paths[], int compress,
+                             int target_width, int window, size_t budget, int huge)
 {
     int i;
     sosg_image_p images = calloc(1, sizeof(sosg_image_t));
     if (images) {
-        // Allocate space with the assumption that all the paths are valid
-        images->images = calloc(num_paths, sizeof(img_p));
-        images->num_images = num_paths;
+        images->compress = compress;
+        images->target_width = target_width;
+        images->budget = budget;
+        images->huge = huge;
+        images->shown = -1;
+        images->pinned = -1;
+        images->updated = 1;
+        images->mutex = SDL_CreateMutex();
+        images->changed = SDL_CreateCond();
         
-        // Copy the file paths for each images to load
-        // TODO: check if the files actually are valid
-        for (i = 0; i < images->num_images; i++) {
-            images->images[i] = calloc(1, sizeof(img_t));
-            images->images[i]->path = strdup(paths[i]);
+        // A pack has every frame ready to go already, with the page cache
+        // taking the place of the window
+        if (num_paths == 1 && sosg_pack_is_pack(paths[0])) {
+            if (open_pack(images, paths[0])) {
+                sosg_image_destroy(images);
+                return NULL;
+            }
+            images->window = window > 0 ? window : images->num_images;
+            return images;
         }
-        
-        // Load in a few images at the start
-        int preload = images->num_images > PRELOAD_IMAGES ? PRELOAD_IMAGES : images->num_images;
-        for (i = 0; i < preload; i++) {
-            load_image(images->images[i]);
-            images->num_loaded++;
+
+        // Nothing is checked until it's needed, so that huge sequences start
+        // as quickly as small ones
+        images->playlist = sosg_playlist_init(num_paths, paths);
+        images->num_images = sosg_playlist_get_count(images->playlist);
+        images->images = calloc(images->num_images, sizeof(img_t));
+        if (!images->playlist || !images->images) {
+            sosg_image_destroy(images);
+            return NULL;
+        }
+        images->window = window > 0 ? window : images->num_images;
+
+        // Start on the first image that looks valid, and work out what size
+        // it will be decoded at from its header so the renderer can be set
+        // up for it straight away
+        for (i = 0; i < SDL_min(images->num_images, PROBE_LIMIT); i++) {
+            const char *path = sosg_playlist_get_path(images->playlist, i);
+            int w = 0, h = 0;
+            int ret = probe_image(path, &w, &h);
+            if (ret < 0) {
+                images->images[i].state = IMG_FAILED;
+                continue;
+            }
+            if (!ret) {
+                decoded_size(images, path, &w, &h);
+                images->resolution[0] = w;
+                images->resolution[1] = h;
+            }
+            images->index = i;
+            break;
         }
+        if (i == images->num_images) {
+            fprintf(stderr, "Error: No images to show\n");
+            sosg_image_destroy(images);
+            return NULL;
+        }
+        // Past the probes, start on the next one and let the loaders find
+        // out whether it's any good
+        if (i == PROBE_LIMIT) images->index = i;
+        if (i) fprintf(stderr, "Warning: Skipped %d images that are not valid\n", i);
+
+        // Everything is decoded in the background, starting with a preview of
+        // the first image, so init returns right away
+        images->want_preview = 1;
         
-        // If we still have more images left, load them in a new thread
-        if (images->num_images > PRELOAD_IMAGES) {
+        // Keep the window filled with a loader per spare core, since
+        // decoding is by far the slowest part
+        if (images->num_images > 0) {
+            int num_loaders = SDL_max(2, SDL_GetCPUCount() - 1);
+            num_loaders = SDL_min(SDL_min(num_loaders, MAX_LOADERS), images->window);
             images->running = 1;
-            images->load_thread = SDL_CreateThread(sosg_image_load, "Loading thread", images);
+            for (i = 0; i < num_loaders; i++) {
+                images->loaders[images->num_loaders] =
+                    SDL_CreateThread(sosg_image_load, "Loading thread", images);
+                if (!images->loaders[images->num_loaders]) {
+                    fprintf(stderr, "Warning: Could not create loading thread: %s\n", SDL_GetError());
+                    break;
+                }
+                images->num_loaders++;
+            }
         }
-
-        images->index = 0;
-        images->updated = 1;
     }
     
     return images;
@@ -108,54 +837,276 @@ void sosg_image_destroy(sosg_image_p images)
 {
     int i;
     if (images) {
+        SDL_LockMutex(images->mutex);
         images->running = 0;
-        if (images->load_thread) SDL_WaitThread(images->load_thread, NULL);
+        SDL_CondBroadcast(images->changed);
+        SDL_UnlockMutex(images->mutex);
+        for (i = 0; i < images->num_loaders; i++) {
+            SDL_WaitThread(images->loaders[i], NULL);
+        }
     
         if (images->images) {
             for (i = 0; i < images->num_images; i++) {
-                if (images->images[i]) {
-                    if (images->images[i]->buffer) SDL_FreeSurface(images->images[i]->buffer);
-                    if (images->images[i]->path) free(images->images[i]->path);
-                    free(images->images[i]);
-                }
+                // Compressed data in a pack belongs to the map
+                if (images->pack) images->images[i].frame.data = NULL;
+                free_frame(&images->images[i].frame);
             }
             free(images->images);
         }
+        sosg_playlist_destroy(images->playlist);
+        free_frame(&images->preview);
+        for (i = 0; i < images->num_pools; i++) sosg_pool_destroy(images->pools[i]);
+        if (images->pack) sosg_pack_close(images->pack);
+        if (images->changed) SDL_DestroyCond(images->changed);
+        if (images->mutex) SDL_DestroyMutex(images->mutex);
         free(images);
     }
 }
 
 void sosg_image_get_resolution(sosg_image_p images, int *resolution)
 {
-    if (resolution && images && images->images[images->index]->buffer) {
-        resolution[0] = images->images[images->index]->buffer->w;
-        resolution[1] = images->images[images->index]->buffer->h;
+    if (resolution && images) {
+        SDL_LockMutex(images->mutex);
+        img_p img = &images->images[images->index];
+        if (img->state == IMG_LOADED) {
+            resolution[0] = img->frame.w;
+            resolution[1] = img->frame.h;
+        } else if (images->resolution[0]) {
+            // Known from the header before anything has been decoded
+            resolution[0] = images->resolution[0];
+            resolution[1] = images->resolution[1];
+        }
+        SDL_UnlockMutex(images->mutex);
+    }
+}
+
+void sosg_image_get_memory(sosg_image_p images, size_t *used, size_t *spare)
+{
+    int i, blocks, spare_blocks;
+
+    if (used) *used = 0;
+    if (spare) *spare = 0;
+    if (images) {
+        SDL_LockMutex(images->mutex);
+        for (i = 0; i < images->num_pools; i++) {
+            size_t size = sosg_pool_get_block_size(images->pools[i]);
+            sosg_pool_get_stats(images->pools[i], &blocks, &spare_blocks);
+            if (used) *used += blocks*size;
+            if (spare) *spare += spare_blocks*size;
+        }
+        SDL_UnlockMutex(images->mutex);
+    }
+}
+
+// Compression can only be checked for once there is a GL context, which is
+// after the loaders have started
+void sosg_image_set_compress(sosg_image_p images, int compress)
+{
+    int i;
+    if (images) {
+        SDL_LockMutex(images->mutex);
+        if (compress != images->compress) {
+            images->compress = compress;
+            // Reload anything already compressed the other way, except for
+            // images that come compressed
+            for (i = 0; i < images->num_images; i++) {
+                img_p img = &images->images[i];
+                const char *path = sosg_playlist_get_path(images->playlist, i);
+                if (img->state == IMG_LOADED && path && !has_extension(path, ".ktx") &&
+                    i != images->shown && i != images->pinned) {
+                    evict(images, i);
+                }
+            }
+            SDL_CondBroadcast(images->changed);
+        }
+        SDL_UnlockMutex(images->mutex);
+    }
+}
+
+// Scale down images bigger than max_size as they load, for when the renderer
+// can't split them up into tiles
+void sosg_image_set_max_size(sosg_image_p images, int max_size)
+{
+    int i;
+    if (images) {
+        SDL_LockMutex(images->mutex);
+        SDL_AtomicSet(&images->max_size, max_size);
+        // Reload anything that was already loaded too big
+        for (i = 0; i < images->num_images; i++) {
+            img_p img = &images->images[i];
+            if (img->state == IMG_LOADED && !images->pack &&
+                (img->frame.w > max_size || img->frame.h > max_size) &&
+                i != images->shown && i != images->pinned) {
+                evict(images, i);
+            }
+        }
+        SDL_CondBroadcast(images->changed);
+        SDL_UnlockMutex(images->mutex);
+    }
+}
+
+// Move the current index, with the mutex held
+static void move_to(sosg_image_p images, int index, int direction)
+{
+    int count = images->num_images;
+
+    if (index == images->index) return;
+    images->direction = direction;
+    images->index = index;
+    images->updated = 1;
+    SDL_CondBroadcast(images->changed);
+    if (images->pack) {
+        sosg_pack_prefetch(images->pack, (index + direction + count) % count);
+    }
+}
+
+static void advance_playhead(sosg_image_p images)
+{
+    // The clock only starts once the first image is on screen
+    if (images->shown < 0) return;
+
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (!images->play_start) images->play_start = now;
+
+    int64_t tick = (double)(now - images->play_start)*images->fps/
+                   (double)SDL_GetPerformanceFrequency();
+    move_to(images, (images->base + tick) % images->num_images, 1);
+}
+
+void sosg_image_set_fps(sosg_image_p images, float fps)
+{
+    if (images) {
+        SDL_LockMutex(images->mutex);
+        images->fps = fps;
+        images->base = images->index;
+        images->play_start = 0;
+        images->late_index = -1;
+        images->direction = 1;
+        SDL_CondBroadcast(images->changed);
+        SDL_UnlockMutex(images->mutex);
+    }
+}
+
+// Milliseconds until the playhead moves on, or -1 if it isn't playing
+int sosg_image_get_delay(sosg_image_p images)
+{
+    int delay = -1;
+
+    if (images) {
+        SDL_LockMutex(images->mutex);
+        // Until the first image is on screen the clock hasn't started, and
+        // the loader wakes the main loop once that image is ready
+        if (images->fps > 0.0 && images->play_start) {
+            double elapsed = (double)(SDL_GetPerformanceCounter() - images->play_start)/
+                             (double)SDL_GetPerformanceFrequency();
+            double next = (floor(elapsed*images->fps) + 1.0)/images->fps;
+            delay = (int)ceil((next - elapsed)*1000.0);
+        }
+        SDL_UnlockMutex(images->mutex);
+    }
+
+    return delay;
+}
+
+void sosg_image_get_stats(sosg_image_p images, int *dropped, int *late)
+{
+    if (images) {
+        SDL_LockMutex(images->mutex);
+        if (dropped) *dropped = images->dropped;
+        if (late) *late = images->late;
+        SDL_UnlockMutex(images->mutex);
     }
 }
 
 void sosg_image_set_index(sosg_image_p images, int index)
 {
     if (images) {
+        SDL_LockMutex(images->mutex);
         // Act on the difference between the last input and the current one
         // to avoid some weirdness while the images are still loading
         int i = index - images->last_index;
         images->last_index = index;
         int new_index = images->index + i;
 
-        // Only use images that have completed loading
-        int loaded = images->num_loaded;
-        while (new_index < 0) new_index += loaded;
-        new_index = new_index % loaded;
-        images->index = new_index;
-        images->updated = 1;
+        // Images outside the window get loaded once we land on them
+        int count = images->num_images;
+        while (new_index < 0) new_index += count;
+        new_index = new_index % count;
+
+        // During playback this seeks, and playback carries on from there
+        if (images->fps > 0.0) {
+            images->base = ((images->base + i) % count + count) % count;
+            images->seeked = 1;
+            move_to(images, new_index, 1);
+        } else {
+            move_to(images, new_index, i > 0 ? 1 : -1);
+        }
+        SDL_UnlockMutex(images->mutex);
     }
 }
 
-SDL_Surface *sosg_image_update(sosg_image_p images)
+// The loaded frame offset images ahead of the current index in the direction
+// the user is moving in, or behind it if offset is negative, or NULL if it
+// isn't loaded yet.  It won't be freed until the next call, so the renderer
+// can upload it before the user gets to it.
+sosg_frame_p sosg_image_peek(sosg_image_p images, int offset)
 {
-    // Only pass a surface if we switched to a new image
-    if (!images || !images->num_loaded || !images->updated) return NULL;
-    
-    images->updated = 0;
-    return images->images[images->index]->buffer;
+    sosg_frame_p frame = NULL;
+
+    if (!images) return NULL;
+
+    SDL_LockMutex(images->mutex);
+    int count = images->num_images;
+    int step = images->direction < 0 ? -offset : offset;
+    int i = ((images->index + step) % count + count) % count;
+    images->pinned = -1;
+    if (images->images[i].state == IMG_LOADED) {
+        frame = &images->images[i].frame;
+        images->pinned = i;
+    }
+    SDL_UnlockMutex(images->mutex);
+
+    return frame;
+}
+
+sosg_frame_p sosg_image_update(sosg_image_p images)
+{
+    sosg_frame_p frame = NULL;
+
+    if (!images) return NULL;
+
+    // Only pass a frame if we switched to a new image that has loaded,
+    // otherwise keep showing the last one until the loader catches up
+    SDL_LockMutex(images->mutex);
+    if (images->fps > 0.0) advance_playhead(images);
+    img_p img = &images->images[images->index];
+    if (images->updated && (img->state == IMG_LOADED || img->state == IMG_FAILED)) {
+        images->updated = 0;
+        if (img->state == IMG_LOADED) {
+            frame = &img->frame;
+            // Count the frames the playhead went past without them being shown
+            if (images->fps > 0.0 && images->shown >= 0 && !images->seeked) {
+                int skipped = (images->index - images->shown + images->num_images) % images->num_images;
+                if (skipped > 1) images->dropped += skipped - 1;
+            }
+            images->seeked = 0;
+            images->shown = images->index;
+            // The previously shown image may be out of the window now
+            SDL_CondBroadcast(images->changed);
+        }
+    } else if (images->updated && images->fps > 0.0 && images->shown >= 0 &&
+               images->late_index != images->index) {
+        // The playhead got to an image before it was loaded
+        images->late++;
+        images->late_index = images->index;
+    }
+    if (images->updated && images->has_preview == 1 &&
+        images->preview_index == images->index) {
+        // Stand in until the real image is ready, leaving updated set
+        images->has_preview = 2;
+        frame = &images->preview;
+    }
+    SDL_UnlockMutex(images->mutex);
+
+    return frame;
 }
@@ -3,13 +3,22 @@
 
 #include "SDL.h"
 #include "SDL_image.h"
+#include "sosg_frame.h"
 
 typedef struct sosg_image_struct *sosg_image_p;
 
-sosg_image_p sosg_image_init(int num_paths, char *paths[]);
+sosg_image_p sosg_image_init(int num_paths, char *paths[], int compress,
+                             int target_width, int window, size_t budget, int huge);
 void sosg_image_destroy(sosg_image_p images);
 void sosg_image_get_resolution(sosg_image_p images, int *resolution);
+void sosg_image_set_compress(sosg_image_p images, int compress);
+void sosg_image_set_max_size(sosg_image_p images, int max_size);
 void sosg_image_set_index(sosg_image_p images, int index);
-SDL_Surface *sosg_image_update(sosg_image_p images);
+void sosg_image_set_fps(sosg_image_p images, float fps);
+int sosg_image_get_delay(sosg_image_p images);
+void sosg_image_get_stats(sosg_image_p images, int *dropped, int *late);
+void sosg_image_get_memory(sosg_image_p images, size_t *used, size_t *spare);
+sosg_frame_p sosg_image_peek(sosg_image_p images, int offset);
+sosg_frame_p sosg_image_update(sosg_image_p images);
 
 #endif /* _SOSG_IMAGE_H_ */
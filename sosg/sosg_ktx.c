@@ -0,0 +1,352 @@
+/*
+Filename:     sosg_ktx.c
+Content:      GPU compressed frames for Science on a Snow Globe
+Authors:      Nirav Patel
+Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
+
+    Permission to use, copy, modify, and/or distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "sosg_ktx.h"
+#include <stdio.h>
+#include <string.h>
+
+// Large datasets are mostly bound by uploading the frames, and compressed
+// textures are 4 to 8 times smaller than BGRA.  Frames can either be
+// compressed offline into KTX containers in any format the driver supports,
+// like BC1, BC7 or ETC2, or compressed to BC1 here on the loader thread.
+
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+
+static const uint8_t ktx_identifier[12] = {
+    0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+typedef struct ktx_header_struct {
+    uint8_t identifier[12];
+    uint32_t endianness;
+    uint32_t gl_type;
+    uint32_t gl_type_size;
+    uint32_t gl_format;
+    uint32_t gl_internal_format;
+    uint32_t gl_base_internal_format;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    uint32_t pixel_depth;
+    uint32_t array_elements;
+    uint32_t faces;
+    uint32_t mipmap_levels;
+    uint32_t key_value_bytes;
+} ktx_header_t;
+
+int sosg_ktx_probe(const char *path, int *w, int *h)
+{
+    ktx_header_t header;
+    FILE *file = fopen(path, "rb");
+    int ok = file && fread(&header, sizeof(header), 1, file) == 1 &&
+             !memcmp(header.identifier, ktx_identifier, sizeof(ktx_identifier)) &&
+             header.endianness == 0x04030201;
+
+    if (file) fclose(file);
+    if (!ok) return -1;
+
+    *w = header.pixel_width;
+    *h = header.pixel_height;
+    return 0;
+}
+
+int sosg_ktx_load(const char *path, sosg_frame_p frame)
+{
+    // Only filled in once everything has been read, so a frame that failed
+    // to load is left empty
+    sosg_frame_t ktx;
+    ktx_header_t header;
+    uint32_t size;
+    long total = 0;
+    int i;
+    FILE *file = fopen(path, "rb");
+
+    if (!file) {
+        fprintf(stderr, "Error: Could not open %s\n", path);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.identifier, ktx_identifier, sizeof(ktx_identifier))) {
+        fprintf(stderr, "Error: %s is not a KTX file\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    // Only plain 2D compressed textures written on a machine of the same
+    // endianness, which is all any of the encoders produce here
+    if (header.endianness != 0x04030201 || header.gl_type != 0 ||
+        header.pixel_depth > 1 || header.array_elements > 1 || header.faces != 1) {
+        fprintf(stderr, "Error: %s is not a 2D compressed KTX texture\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    memset(&ktx, 0, sizeof(sosg_frame_t));
+    ktx.format = SOSG_FRAME_COMPRESSED;
+    ktx.w = header.pixel_width;
+    ktx.h = header.pixel_height;
+    ktx.internal = header.gl_internal_format;
+    ktx.levels = header.mipmap_levels ? header.mipmap_levels : 1;
+    if (ktx.levels > SOSG_FRAME_MAX_LEVELS) ktx.levels = SOSG_FRAME_MAX_LEVELS;
+
+    fseek(file, header.key_value_bytes, SEEK_CUR);
+
+    // Each level is prefixed with its size and padded to 4 bytes, so find the
+    // sizes first to be able to read them back to back in one buffer
+    long start = ftell(file);
+    for (i = 0; i < ktx.levels; i++) {
+        if (fread(&size, sizeof(size), 1, file) != 1) break;
+        ktx.sizes[i] = size;
+        total += size;
+        fseek(file, (size + 3) & ~3, SEEK_CUR);
+    }
+    if (i < ktx.levels || !total) {
+        fprintf(stderr, "Error: %s is truncated\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    ktx.data = malloc(total);
+    if (!ktx.data) {
+        fprintf(stderr, "Error: Could not allocate %ld bytes for %s\n", total, path);
+        fclose(file);
+        return -1;
+    }
+
+    fseek(file, start, SEEK_SET);
+    uint8_t *level = ktx.data;
+    for (i = 0; i < ktx.levels; i++) {
+        fseek(file, sizeof(size), SEEK_CUR);
+        if (fread(level, ktx.sizes[i], 1, file) != 1) break;
+        fseek(file, ((ktx.sizes[i] + 3) & ~3) - ktx.sizes[i], SEEK_CUR);
+        level += ktx.sizes[i];
+    }
+    fclose(file);
+
+    if (i < ktx.levels) {
+        fprintf(stderr, "Error: %s is truncated\n", path);
+        free(ktx.data);
+        return -1;
+    }
+
+    *frame = ktx;
+    return 0;
+}
+
+static inline uint16_t pack565(const int *c)
+{
+    return ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+}
+
+static inline void unpack565(uint16_t p, int *c)
+{
+    int r = (p >> 11) & 0x1F;
+    int g = (p >> 5) & 0x3F;
+    int b = p & 0x1F;
+    c[0] = (r << 3) | (r >> 2);
+    c[1] = (g << 2) | (g >> 4);
+    c[2] = (b << 3) | (b >> 2);
+}
+
+// Compress one 4x4 block of RGB with a simple range fit along the diagonal
+// of the bounding box, which is plenty for photographic globe imagery
+static void encode_block(int rgb[16][3], uint8_t *out)
+{
+    int i, c;
+    int lo[3] = {255, 255, 255};
+    int hi[3] = {0, 0, 0};
+    int palette[4][3];
+    uint32_t indices = 0;
+
+    for (i = 0; i < 16; i++) {
+        for (c = 0; c < 3; c++) {
+            if (rgb[i][c] < lo[c]) lo[c] = rgb[i][c];
+            if (rgb[i][c] > hi[c]) hi[c] = rgb[i][c];
+        }
+    }
+
+    // Inset the box a little so the endpoints aren't wasted on outliers
+    for (c = 0; c < 3; c++) {
+        int inset = (hi[c] - lo[c]) >> 4;
+        lo[c] += inset;
+        hi[c] -= inset;
+    }
+
+    uint16_t c0 = pack565(hi);
+    uint16_t c1 = pack565(lo);
+
+    // color0 > color1 selects the 4 color mode without transparency
+    if (c0 < c1) {
+        uint16_t t = c0;
+        c0 = c1;
+        c1 = t;
+    }
+
+    if (c0 != c1) {
+        unpack565(c0, palette[0]);
+        unpack565(c1, palette[1]);
+        for (c = 0; c < 3; c++) {
+            palette[2][c] = (2*palette[0][c] + palette[1][c])/3;
+            palette[3][c] = (palette[0][c] + 2*palette[1][c])/3;
+        }
+
+        for (i = 0; i < 16; i++) {
+            int best = 0;
+            int best_error = 0x7FFFFFFF;
+            int p;
+            for (p = 0; p < 4; p++) {
+                int error = 0;
+                for (c = 0; c < 3; c++) {
+                    int d = rgb[i][c] - palette[p][c];
+                    error += d*d;
+                }
+                if (error < best_error) {
+                    best = p;
+                    best_error = error;
+                }
+            }
+            indices |= (uint32_t)best << (i*2);
+        }
+    }
+
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    out[4] = indices & 0xFF;
+    out[5] = (indices >> 8) & 0xFF;
+    out[6] = (indices >> 16) & 0xFF;
+    out[7] = indices >> 24;
+}
+
+static void encode_level(const uint32_t *pixels, int pitch, int w, int h, uint8_t *out)
+{
+    int x, y, i, j;
+    int rgb[16][3];
+
+    for (y = 0; y < h; y += 4) {
+        for (x = 0; x < w; x += 4) {
+            // Repeat the last row and column for sizes that aren't a
+            // multiple of the block size
+            for (j = 0; j < 4; j++) {
+                const uint32_t *row = pixels + (y + j < h ? y + j : h - 1)*pitch;
+                for (i = 0; i < 4; i++) {
+                    uint32_t p = row[x + i < w ? x + i : w - 1];
+                    rgb[j*4+i][0] = (p >> 16) & 0xFF;
+                    rgb[j*4+i][1] = (p >> 8) & 0xFF;
+                    rgb[j*4+i][2] = p & 0xFF;
+                }
+            }
+            encode_block(rgb, out);
+            out += 8;
+        }
+    }
+}
+
+// Halve a level in place with a box filter, since glGenerateMipmap can't be
+// used on compressed textures
+static void downsample(uint32_t *pixels, int pitch, int w, int h)
+{
+    int x, y, c;
+    int nw = w > 1 ? w/2 : 1;
+    int nh = h > 1 ? h/2 : 1;
+
+    for (y = 0; y < nh; y++) {
+        const uint32_t *r0 = pixels + (y*2)*pitch;
+        const uint32_t *r1 = pixels + (h > 1 ? y*2 + 1 : y*2)*pitch;
+        uint32_t *out = pixels + y*pitch;
+        for (x = 0; x < nw; x++) {
+            int x0 = x*2;
+            int x1 = w > 1 ? x*2 + 1 : x*2;
+            uint32_t p = 0;
+            for (c = 0; c < 32; c += 8) {
+                uint32_t sum = ((r0[x0] >> c) & 0xFF) + ((r0[x1] >> c) & 0xFF) +
+                               ((r1[x0] >> c) & 0xFF) + ((r1[x1] >> c) & 0xFF);
+                p |= ((sum + 2) >> 2) << c;
+            }
+            out[x] = p;
+        }
+    }
+}
+
+size_t sosg_ktx_layout(sosg_frame_p frame, int w, int h)
+{
+    size_t total = 0;
+
+    memset(frame, 0, sizeof(sosg_frame_t));
+    frame->format = SOSG_FRAME_COMPRESSED;
+    frame->w = w;
+    frame->h = h;
+    frame->internal = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+    // The full mip chain, down to 1x1
+    while (frame->levels < SOSG_FRAME_MAX_LEVELS) {
+        frame->sizes[frame->levels] = ((w + 3)/4)*((h + 3)/4)*8;
+        total += frame->sizes[frame->levels];
+        frame->levels++;
+        if (w == 1 && h == 1) break;
+        w = w > 1 ? w/2 : 1;
+        h = h > 1 ? h/2 : 1;
+    }
+
+    return total;
+}
+
+void sosg_ktx_encode_into(SDL_Surface *surface, sosg_frame_p frame)
+{
+    int i;
+
+    // The surface is the loader's own scratch copy, so it's fine to shrink
+    // it in place for each level
+    SDL_LockSurface(surface);
+    uint32_t *pixels = surface->pixels;
+    int pitch = surface->pitch/4;
+    uint8_t *out = frame->data;
+    int w = surface->w;
+    int h = surface->h;
+    for (i = 0; i < frame->levels; i++) {
+        encode_level(pixels, pitch, w, h, out);
+        out += frame->sizes[i];
+        downsample(pixels, pitch, w, h);
+        w = w > 1 ? w/2 : 1;
+        h = h > 1 ? h/2 : 1;
+    }
+    SDL_UnlockSurface(surface);
+}
+
+int sosg_ktx_encode(SDL_Surface *surface, sosg_frame_p frame)
+{
+    size_t total = sosg_ktx_layout(frame, surface->w, surface->h);
+
+    frame->data = malloc(total);
+    if (!frame->data) {
+        fprintf(stderr, "Error: Could not allocate %zu bytes for a compressed frame\n", total);
+        return -1;
+    }
+    sosg_ktx_encode_into(surface, frame);
+
+    return 0;
+}
+
+void sosg_ktx_free(sosg_frame_p frame)
+{
+    if (frame->data) free(frame->data);
+    frame->data = NULL;
+    frame->levels = 0;
+}
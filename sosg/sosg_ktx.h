@@ -0,0 +1,15 @@
+#ifndef _SOSG_KTX_H_
+#define _SOSG_KTX_H_
+
+#include "SDL.h"
+#include "sosg_frame.h"
+
+int sosg_ktx_probe(const char *path, int *w, int *h);
+int sosg_ktx_load(const char *path, sosg_frame_p frame);
+int sosg_ktx_encode(SDL_Surface *surface, sosg_frame_p frame);
+// For encoding into a buffer of the caller's, of the size layout returns
+size_t sosg_ktx_layout(sosg_frame_p frame, int w, int h);
+void sosg_ktx_encode_into(SDL_Surface *surface, sosg_frame_p frame);
+void sosg_ktx_free(sosg_frame_p frame);
+
+#endif /* _SOSG_KTX_H_ */
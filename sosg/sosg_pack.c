@@ -0,0 +1,175 @@
+/*
+Filename:     sosg_pack.c
+Content:      Memory mapped frame packs for Science on a Snow Globe
+Authors:      Nirav Patel
+Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
+
+    Permission to use, copy, modify, and/or distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "sosg_pack.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h> // TODO: use the windows equivalent when on windows
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Frames are served straight out of the page cache, so opening a pack of any
+// size is instant and the kernel decides how much of it stays in memory.
+
+typedef struct sosg_pack_struct {
+    int fd;
+    uint8_t *map;
+    size_t length;
+    sosg_pack_header_t *header;
+    sosg_pack_entry_t *entries;
+} sosg_pack_t;
+
+int sosg_pack_is_pack(const char *path)
+{
+    char magic[8];
+    int ret = 0;
+    FILE *file = fopen(path, "rb");
+    if (file) {
+        ret = fread(magic, sizeof(magic), 1, file) == 1 &&
+              !memcmp(magic, SOSG_PACK_MAGIC, sizeof(magic));
+        fclose(file);
+    }
+    return ret;
+}
+
+static int check_pack(sosg_pack_p pack, const char *path)
+{
+    uint32_t i;
+    sosg_pack_header_t *header = pack->header;
+    uint64_t frame_size = 0;
+
+    if (pack->length < sizeof(sosg_pack_header_t) ||
+        memcmp(header->magic, SOSG_PACK_MAGIC, sizeof(header->magic))) {
+        fprintf(stderr, "Error: %s is not a sosg pack\n", path);
+        return -1;
+    }
+    if (header->version != SOSG_PACK_VERSION) {
+        fprintf(stderr, "Error: %s is a version %u pack, expected %d\n",
+            path, header->version, SOSG_PACK_VERSION);
+        return -1;
+    }
+    if (!header->num_frames || header->levels > SOSG_FRAME_MAX_LEVELS ||
+        sizeof(sosg_pack_header_t) + (uint64_t)header->num_frames*sizeof(sosg_pack_entry_t) > pack->length) {
+        fprintf(stderr, "Error: %s has a corrupt header\n", path);
+        return -1;
+    }
+
+    if (header->format == SOSG_FRAME_BGRA) {
+        frame_size = (uint64_t)header->w*header->h*4;
+    } else {
+        for (i = 0; i < header->levels; i++) frame_size += header->sizes[i];
+    }
+
+    for (i = 0; i < header->num_frames; i++) {
+        sosg_pack_entry_t *entry = pack->entries + i;
+        // Written so a corrupt offset can't wrap around past the check
+        if (entry->size != frame_size || entry->size > pack->length ||
+            entry->offset > pack->length - entry->size) {
+            fprintf(stderr, "Error: %s is truncated at frame %u\n", path, i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+sosg_pack_p sosg_pack_open(const char *path)
+{
+    struct stat st;
+    sosg_pack_p pack = calloc(1, sizeof(sosg_pack_t));
+    if (!pack) return NULL;
+
+    pack->fd = open(path, O_RDONLY);
+    if (pack->fd < 0 || fstat(pack->fd, &st)) {
+        fprintf(stderr, "Error: Could not open %s\n", path);
+        free(pack);
+        return NULL;
+    }
+
+    // Read only, so every page of it is the page cache's to drop again and
+    // none of it is charged to us, however big the pack
+    pack->length = st.st_size;
+    pack->map = mmap(NULL, pack->length, PROT_READ, MAP_SHARED, pack->fd, 0);
+    if (pack->map == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map %s\n", path);
+        close(pack->fd);
+        free(pack);
+        return NULL;
+    }
+    pack->header = (sosg_pack_header_t *)pack->map;
+    pack->entries = (sosg_pack_entry_t *)(pack->map + sizeof(sosg_pack_header_t));
+
+    if (check_pack(pack, path)) {
+        sosg_pack_close(pack);
+        return NULL;
+    }
+
+    return pack;
+}
+
+void sosg_pack_close(sosg_pack_p pack)
+{
+    if (pack) {
+        if (pack->map) munmap(pack->map, pack->length);
+        if (pack->fd >= 0) close(pack->fd);
+        free(pack);
+    }
+}
+
+int sosg_pack_get_count(sosg_pack_p pack)
+{
+    return pack ? pack->header->num_frames : 0;
+}
+
+// Point frame at the pixels in the map.  Compressed data belongs to the pack,
+// and only the surface of an uncompressed frame should be freed.  Either way
+// the frame is read only.
+int sosg_pack_get_frame(sosg_pack_p pack, int index, sosg_frame_p frame)
+{
+    sosg_pack_header_t *header = pack->header;
+    uint8_t *pixels = pack->map + pack->entries[index].offset;
+
+    memset(frame, 0, sizeof(sosg_frame_t));
+    frame->format = header->format;
+    frame->w = header->w;
+    frame->h = header->h;
+    frame->readonly = 1;
+
+    if (header->format == SOSG_FRAME_BGRA) {
+        frame->surface = SDL_CreateRGBSurfaceFrom(pixels, header->w, header->h, 32,
+            header->w*4, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+        return frame->surface ? 0 : -1;
+    }
+
+    frame->internal = header->internal;
+    frame->levels = header->levels;
+    memcpy(frame->sizes, header->sizes, sizeof(frame->sizes));
+    frame->data = pixels;
+    return 0;
+}
+
+// Start reading a frame in before it's needed
+void sosg_pack_prefetch(sosg_pack_p pack, int index)
+{
+    if (pack && index >= 0 && index < (int)pack->header->num_frames) {
+        sosg_pack_entry_t *entry = pack->entries + index;
+        madvise(pack->map + entry->offset, entry->size, MADV_WILLNEED);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _SOSG_PACK_H_
+#define _SOSG_PACK_H_
+
+#include "SDL.h"
+#include "sosg_frame.h"
+
+// A pack is a header, an index of frames and then the frames themselves,
+// already in the format they get uploaded in and each aligned to a page so
+// they can be used straight from a memory map.  Every frame in a pack has the
+// same resolution and format.  The header is a multiple of 8 bytes, so the
+// 64 bit fields of the index right after it are aligned in the map.
+
+#define SOSG_PACK_MAGIC "SOSGPACK"
+#define SOSG_PACK_VERSION 2
+#define SOSG_PACK_ALIGN 4096
+
+typedef struct sosg_pack_header_struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_frames;
+    uint32_t w;
+    uint32_t h;
+    uint32_t format;   // enum sosg_frame_format
+    uint32_t internal; // OpenGL internal format of compressed frames
+    uint32_t levels;
+    uint32_t sizes[SOSG_FRAME_MAX_LEVELS];
+    uint32_t reserved; // pads the header to 104 bytes
+} sosg_pack_header_t;
+
+typedef struct sosg_pack_entry_struct {
+    uint64_t offset;
+    uint64_t size;
+} sosg_pack_entry_t;
+
+typedef struct sosg_pack_struct *sosg_pack_p;
+
+int sosg_pack_is_pack(const char *path);
+sosg_pack_p sosg_pack_open(const char *path);
+void sosg_pack_close(sosg_pack_p pack);
+int sosg_pack_get_count(sosg_pack_p pack);
+int sosg_pack_get_frame(sosg_pack_p pack, int index, sosg_frame_p frame);
+void sosg_pack_prefetch(sosg_pack_p pack, int index);
+
+#endif /* _SOSG_PACK_H_ */
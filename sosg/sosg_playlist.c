@@ -0,0 +1,277 @@
+/*
+Filename:     sosg_playlist.c
+Content:      Image sequence enumeration for Science on a Snow Globe
+Authors:      Nirav Patel
+Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
+
+    Permission to use, copy, modify, and/or distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "sosg_playlist.h"
+#include "SDL.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+// SOS datasets can run to 100k frames, which is past what fits on a command
+// line and slow to allocate a string at a time.  All the paths go into one
+// block of names, with an array of offsets into it, so the list costs about
+// the length of the names and a handful of allocations.
+
+#define PLAYLIST_LINE 4096
+
+typedef struct sosg_playlist_struct {
+    char *names;
+    size_t names_len;
+    size_t names_size;
+    size_t *offsets;
+    int count;
+    int size;
+} sosg_playlist_t;
+
+static const char *image_extensions[] = {
+    ".jpg", ".jpeg", ".png", ".ktx", ".bmp", ".tga", ".tif", ".tiff", ".gif", ".webp", NULL
+};
+
+static int is_image(const char *name)
+{
+    int i;
+    const char *ext = strrchr(name, '.');
+    if (!ext) return 0;
+    for (i = 0; image_extensions[i]; i++) {
+        if (!strcasecmp(ext, image_extensions[i])) return 1;
+    }
+    return 0;
+}
+
+static int is_playlist(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext && (!strcasecmp(ext, ".txt") || !strcasecmp(ext, ".m3u") ||
+                   !strcasecmp(ext, ".lst"));
+}
+
+// Add dir/name, or just name if dir is NULL
+static int add_path(sosg_playlist_p playlist, const char *dir, const char *name)
+{
+    size_t dir_len = dir ? strlen(dir) : 0;
+    size_t len = dir_len + (dir ? 1 : 0) + strlen(name) + 1;
+
+    // Both arrays grow geometrically, so this is amortized constant time
+    if (playlist->names_len + len > playlist->names_size) {
+        size_t size = SDL_max(playlist->names_size*2, playlist->names_len + len + 65536);
+        char *names = realloc(playlist->names, size);
+        if (!names) return -1;
+        playlist->names = names;
+        playlist->names_size = size;
+    }
+    if (playlist->count == playlist->size) {
+        int size = playlist->size ? playlist->size*2 : 1024;
+        size_t *offsets = realloc(playlist->offsets, size*sizeof(size_t));
+        if (!offsets) return -1;
+        playlist->offsets = offsets;
+        playlist->size = size;
+    }
+
+    char *out = playlist->names + playlist->names_len;
+    if (dir) {
+        memcpy(out, dir, dir_len);
+        out[dir_len] = '/';
+        out += dir_len + 1;
+    }
+    strcpy(out, name);
+    playlist->offsets[playlist->count++] = playlist->names_len;
+    playlist->names_len += len;
+
+    return 0;
+}
+
+// qsort has no context argument, but the list is only built on the main
+// thread before anything else starts
+static const char *sort_names;
+
+// Compare names with runs of digits compared by their value, so frames
+// numbered without zero padding still go frame2, frame10
+static int compare_names(const char *a, const char *b)
+{
+    const char *start_a = a, *start_b = b;
+
+    while (*a && *b) {
+        if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+            size_t len_a = 0, len_b = 0;
+            while (isdigit((unsigned char)a[len_a])) len_a++;
+            while (isdigit((unsigned char)b[len_b])) len_b++;
+            // A longer number without leading zeros is a bigger one
+            if (len_a != len_b) return len_a < len_b ? -1 : 1;
+            int diff = strncmp(a, b, len_a);
+            if (diff) return diff;
+            a += len_a;
+            b += len_b;
+        } else {
+            if (*a != *b) return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+            a++;
+            b++;
+        }
+    }
+    if (*a || *b) return *a ? 1 : -1;
+
+    // Only differ by leading zeros, which still need an order
+    return strcmp(start_a, start_b);
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    return compare_names(sort_names + *(const size_t *)a, sort_names + *(const size_t *)b);
+}
+
+// Put the paths added since first in order.  The names don't move while the
+// offsets are being sorted.
+static void sort_paths(sosg_playlist_p playlist, int first)
+{
+    sort_names = playlist->names;
+    qsort(playlist->offsets + first, playlist->count - first, sizeof(size_t),
+          compare_offsets);
+}
+
+static int add_directory(sosg_playlist_p playlist, const char *path)
+{
+    struct dirent *entry;
+    int first = playlist->count;
+    DIR *dir = opendir(path);
+
+    if (!dir) {
+        fprintf(stderr, "Warning: Could not open directory %s\n", path);
+        return -1;
+    }
+
+    // Only the names are looked at, which readdir already has, rather than
+    // opening or even stat'ing each of the files
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.' || !is_image(entry->d_name)) continue;
+        if (add_path(playlist, path, entry->d_name)) break;
+    }
+    closedir(dir);
+
+    // readdir comes back in whatever order the filesystem likes, and frames
+    // are numbered, so put them in order
+    sort_paths(playlist, first);
+
+    return 0;
+}
+
+static int add_glob(sosg_playlist_p playlist, const char *pattern)
+{
+    size_t i;
+    int first = playlist->count;
+    glob_t matches;
+
+    // Sorted like a directory rather than by glob, whose order puts frame10
+    // before frame2
+    if (glob(pattern, GLOB_NOSORT, NULL, &matches)) {
+        fprintf(stderr, "Warning: Nothing matches %s\n", pattern);
+        return -1;
+    }
+    for (i = 0; i < matches.gl_pathc; i++) {
+        if (add_path(playlist, NULL, matches.gl_pathv[i])) break;
+    }
+    globfree(&matches);
+    sort_paths(playlist, first);
+
+    return 0;
+}
+
+static int add_playlist(sosg_playlist_p playlist, const char *path)
+{
+    char line[PLAYLIST_LINE];
+    char *dir = NULL;
+    FILE *file = fopen(path, "r");
+
+    if (!file) {
+        fprintf(stderr, "Warning: Could not open playlist %s\n", path);
+        return -1;
+    }
+
+    // Relative paths in a playlist are relative to where the playlist is
+    const char *slash = strrchr(path, '/');
+    if (slash) dir = strndup(path, slash - path);
+
+    while (fgets(line, sizeof(line), file)) {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        // Skip blank lines and comments, which covers the m3u directives
+        if (!len || line[0] == '#') continue;
+        if (add_path(playlist, line[0] == '/' ? NULL : dir, line)) break;
+    }
+    fclose(file);
+    if (dir) free(dir);
+
+    return 0;
+}
+
+sosg_playlist_p sosg_playlist_init(int num_paths, char *paths[])
+{
+    int i;
+    struct stat info;
+    sosg_playlist_p playlist = calloc(1, sizeof(sosg_playlist_t));
+
+    if (playlist) {
+        for (i = 0; i < num_paths; i++) {
+            if (!stat(paths[i], &info) && S_ISDIR(info.st_mode)) {
+                add_directory(playlist, paths[i]);
+            } else if (strpbrk(paths[i], "*?[") && stat(paths[i], &info)) {
+                // A pattern quoted to keep the shell from expanding it past
+                // the argument limit
+                add_glob(playlist, paths[i]);
+            } else if (is_playlist(paths[i])) {
+                add_playlist(playlist, paths[i]);
+            } else {
+                add_path(playlist, NULL, paths[i]);
+            }
+        }
+
+        if (!playlist->count) {
+            fprintf(stderr, "Error: No images to show\n");
+            sosg_playlist_destroy(playlist);
+            return NULL;
+        }
+    }
+
+    return playlist;
+}
+
+void sosg_playlist_destroy(sosg_playlist_p playlist)
+{
+    if (playlist) {
+        if (playlist->names) free(playlist->names);
+        if (playlist->offsets) free(playlist->offsets);
+        free(playlist);
+    }
+}
+
+int sosg_playlist_get_count(sosg_playlist_p playlist)
+{
+    return playlist ? playlist->count : 0;
+}
+
+const char *sosg_playlist_get_path(sosg_playlist_p playlist, int index)
+{
+    if (!playlist || index < 0 || index >= playlist->count) return NULL;
+    return playlist->names + playlist->offsets[index];
+}
@@ -0,0 +1,16 @@
+#ifndef _SOSG_PLAYLIST_H_
+#define _SOSG_PLAYLIST_H_
+
+// Expands the command line into a list of image paths.  Each argument can be
+// an image, a directory of images, a quoted glob pattern, or a playlist file
+// with one path per line.  Only the names are gathered here; nothing is
+// opened or checked until it is about to be shown.
+
+typedef struct sosg_playlist_struct *sosg_playlist_p;
+
+sosg_playlist_p sosg_playlist_init(int num_paths, char *paths[]);
+void sosg_playlist_destroy(sosg_playlist_p playlist);
+int sosg_playlist_get_count(sosg_playlist_p playlist);
+const char *sosg_playlist_get_path(sosg_playlist_p playlist, int index);
+
+#endif /* _SOSG_PLAYLIST_H_ */
@@ -0,0 +1,187 @@
+/*
+Filename:     sosg_pool.c
+Content:      Frame buffer pool for Science on a Snow Globe
+Authors:      Nirav Patel
+Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
+
+    Permission to use, copy, modify, and/or distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "sosg_pool.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Frames are megabytes each, so every block is its own mapping.  That keeps
+// them out of the heap entirely, page aligned for uploads and DMA, and lets
+// the kernel back them with huge pages.
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+typedef struct sosg_pool_struct {
+    size_t block_size;
+    size_t map_size;
+    int huge;
+    SDL_mutex *mutex;
+    int used;
+    int num_spare;
+    int max_spare;
+    void **spare;
+} sosg_pool_t;
+
+static void *map_block(sosg_pool_p pool)
+{
+    void *block = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    // Pages reserved through vm.nr_hugepages, if there are any free
+    if (pool->huge) {
+        block = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif /* MAP_HUGETLB */
+    if (block == MAP_FAILED) {
+        block = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+        // Otherwise ask for transparent huge pages
+        if (pool->huge) madvise(block, pool->map_size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    }
+
+    return block;
+}
+
+sosg_pool_p sosg_pool_init(size_t block_size, int spare, int huge)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    sosg_pool_p pool;
+
+    if (!block_size) return NULL;
+
+    pool = calloc(1, sizeof(sosg_pool_t));
+    if (pool) {
+        pool->block_size = block_size;
+        pool->huge = huge;
+        if (huge) page = HUGE_PAGE_SIZE;
+        pool->map_size = (block_size + page - 1)/page*page;
+        pool->max_spare = spare > 0 ? spare : 0;
+        pool->spare = calloc(pool->max_spare + 1, sizeof(void *));
+        pool->mutex = SDL_CreateMutex();
+        if (!pool->spare || !pool->mutex) {
+            sosg_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void sosg_pool_destroy(sosg_pool_p pool)
+{
+    int i;
+    if (pool) {
+        if (pool->used) {
+            fprintf(stderr, "Warning: %d frame buffers still in use\n", pool->used);
+        }
+        for (i = 0; i < pool->num_spare; i++) munmap(pool->spare[i], pool->map_size);
+        if (pool->spare) free(pool->spare);
+        if (pool->mutex) SDL_DestroyMutex(pool->mutex);
+        free(pool);
+    }
+}
+
+size_t sosg_pool_get_block_size(sosg_pool_p pool)
+{
+    return pool ? pool->block_size : 0;
+}
+
+void *sosg_pool_alloc(sosg_pool_p pool)
+{
+    void *block = NULL;
+
+    if (!pool) return NULL;
+
+    SDL_LockMutex(pool->mutex);
+    if (pool->num_spare) block = pool->spare[--pool->num_spare];
+    if (block) pool->used++;
+    SDL_UnlockMutex(pool->mutex);
+    if (block) return block;
+
+    // Mapping is slow enough to do without holding up other threads
+    block = map_block(pool);
+    if (!block) {
+        fprintf(stderr, "Error: Could not map a %zu byte frame buffer\n", pool->map_size);
+        return NULL;
+    }
+    SDL_LockMutex(pool->mutex);
+    pool->used++;
+    SDL_UnlockMutex(pool->mutex);
+
+    return block;
+}
+
+void sosg_pool_free(sosg_pool_p pool, void *block)
+{
+    if (!pool || !block) return;
+
+    // Keep enough around to cover the churn of frames being replaced, and
+    // give anything past that back to the system
+    SDL_LockMutex(pool->mutex);
+    pool->used--;
+    if (pool->num_spare < pool->max_spare) {
+        pool->spare[pool->num_spare++] = block;
+        block = NULL;
+    }
+    SDL_UnlockMutex(pool->mutex);
+
+    if (block) munmap(block, pool->map_size);
+}
+
+void sosg_pool_get_stats(sosg_pool_p pool, int *used, int *spare)
+{
+    if (pool) {
+        SDL_LockMutex(pool->mutex);
+        if (used) *used = pool->used;
+        if (spare) *spare = pool->num_spare;
+        SDL_UnlockMutex(pool->mutex);
+    }
+}
+
+SDL_Surface *sosg_pool_create_surface(sosg_pool_p pool, int w, int h)
+{
+    if (!pool || (size_t)w*h*4 > pool->block_size) return NULL;
+
+    void *pixels = sosg_pool_alloc(pool);
+    if (!pixels) return NULL;
+
+    SDL_Surface *surface = SDL_CreateRGBSurfaceFrom(pixels, w, h, 32, w*4,
+        0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    if (!surface) {
+        sosg_pool_free(pool, pixels);
+        return NULL;
+    }
+    // SDL doesn't free pixels it was given, so remember where they go back to
+    surface->userdata = pool;
+
+    return surface;
+}
+
+void sosg_pool_free_surface(SDL_Surface *surface)
+{
+    if (surface) {
+        if (surface->userdata) sosg_pool_free(surface->userdata, surface->pixels);
+        SDL_FreeSurface(surface);
+    }
+}
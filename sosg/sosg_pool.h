@@ -0,0 +1,25 @@
+#ifndef _SOSG_POOL_H_
+#define _SOSG_POOL_H_
+
+#include "SDL.h"
+
+// Fixed size, page aligned blocks for frames that are all the same size.
+// Freed blocks are kept to be handed out again rather than going back to the
+// heap, so memory stays flat however many frames come and go.  Safe to use
+// from any thread.
+
+typedef struct sosg_pool_struct *sosg_pool_p;
+
+sosg_pool_p sosg_pool_init(size_t block_size, int spare, int huge);
+void sosg_pool_destroy(sosg_pool_p pool);
+size_t sosg_pool_get_block_size(sosg_pool_p pool);
+void *sosg_pool_alloc(sosg_pool_p pool);
+void sosg_pool_free(sosg_pool_p pool, void *block);
+void sosg_pool_get_stats(sosg_pool_p pool, int *used, int *spare);
+
+// A 32 bit ARGB surface whose pixels are a block from the pool, which
+// sosg_pool_free_surface gives back.  Any other surface is just freed.
+SDL_Surface *sosg_pool_create_surface(sosg_pool_p pool, int w, int h);
+void sosg_pool_free_surface(SDL_Surface *surface);
+
+#endif /* _SOSG_POOL_H_ */
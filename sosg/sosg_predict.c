@@ -18,6 +18,9 @@ Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
 */
 
 #include "sosg_predict.h"
+#include "sosg_event.h"
+#include "sosg_queue.h"
+#include "sosg_pool.h"
 #include "SDL_net.h"
 #include "SDL2_gfxPrimitives.h"
 #include "SDL_image.h"
@@ -34,6 +37,9 @@ Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
 #define PREDICT_VISIBLE 0x00FF0066
 #define PREDICT_HIDDEN 0xFF000066
 
+// One being drawn by the client thread, one waiting and one being shown
+#define PREDICT_SLOTS 3
+
 typedef struct satellite_struct {
     char *name;
     SDL_Surface *name_surf;
@@ -46,15 +52,19 @@ typedef struct satellite_struct {
 
 typedef struct sosg_predict_struct {
     char *path;
-    SDL_Surface *buffer;
-    SDL_Surface *update_surf;
+    // The client thread draws into free slots and queues them up as ready,
+    // and the main loop hands them back once it has moved on to a newer one
+    SDL_Surface *slots[PREDICT_SLOTS];
+    sosg_queue_p free_slots;
+    sosg_queue_p ready_slots;
+    sosg_pool_p pool;
+    SDL_Surface *current;
+    sosg_frame_t frame;
     TTF_Font *font;
     SDL_Thread *client_thread;
-    SDL_mutex *update_lock;
     SDL_mutex *client_lock;
     SDL_cond *client_timeout;
     int running;
-    int should_update;
     
     // TODO: split the predict client thread into a separate file/struct
     sat *sats;
@@ -180,8 +190,8 @@ static int sosg_predict_update_sat(sosg_predict_p predict, sat_p input)
     }
     
     // convert LonW and LatN to equirectangular pixel coordinates
-    input->x = (int)floor((float)(predict->buffer->w - 1)*(540.0-input->longitude)/360.0)%predict->buffer->w;
-    input->y = (int)floor((float)(predict->buffer->h - 1)*(90.0-input->latitude)/180.0);
+    input->x = (int)floor((float)(predict->path_surf->w - 1)*(540.0-input->longitude)/360.0)%predict->path_surf->w;
+    input->y = (int)floor((float)(predict->path_surf->h - 1)*(90.0-input->latitude)/180.0);
 //    printf("%s %f %f %c %d %d\n",input->name, input->longitude, input->latitude,
 //        input->visibility, input->x, input->y);
     
@@ -236,6 +246,7 @@ static int sosg_predict_update_sats(sosg_predict_p predict)
 {
     int i = 0;
     SDL_Rect pos;
+    SDL_Surface *surface;
     
     // FIXME: Port this to SDL2_gfx
     // for (i = 0; i < predict->num_sats; i++) {
@@ -252,9 +263,11 @@ static int sosg_predict_update_sats(sosg_predict_p predict)
     //     }
     // }
     
-    // lock around blitting to the update_surf since it is used in the main thread
-    SDL_mutexP(predict->update_lock);
-    SDL_BlitSurface(predict->path_surf, NULL, predict->update_surf, NULL);
+    // If the main loop hasn't taken the last update yet, there is no slot to
+    // draw into, so just try again next time
+    if (sosg_queue_pop(predict->free_slots, &surface)) return -1;
+    
+    SDL_BlitSurface(predict->path_surf, NULL, surface, NULL);
     for (i = 0; i < predict->num_sats; i++) {
         // TODO: deal with wrapping around the world
         pos.x = predict->sats[i].x - predict->sat_icon->w/2;
@@ -262,17 +275,16 @@ static int sosg_predict_update_sats(sosg_predict_p predict)
         // highlight visible satellites
         // FIXME: Port this to SDL2_gfx
         // if (predict->sats[i].visibility == 'V') {
-        //     filledCircleColor(predict->update_surf, predict->sats[i].x, 
+        //     filledCircleColor(surface, predict->sats[i].x, 
         //         predict->sats[i].y, predict->sat_icon->w/2, PREDICT_VISIBLE);
         // }
-        SDL_BlitSurface(predict->sat_icon, NULL, predict->update_surf, &pos);
+        SDL_BlitSurface(predict->sat_icon, NULL, surface, &pos);
         // put the name next to the icon
         pos.x += predict->sat_icon->w;
-        SDL_BlitSurface(predict->sats[i].name_surf, NULL, predict->update_surf,
-            &pos);
+        SDL_BlitSurface(predict->sats[i].name_surf, NULL, surface, &pos);
     }
-    predict->should_update = 1;
-    SDL_mutexV(predict->update_lock);
+    sosg_queue_push(predict->ready_slots, &surface);
+    sosg_event_wake();
     
     return 0;
 }
@@ -322,13 +334,15 @@ static int sosg_predict_client(void *data)
     return 0;   
 }
 
-sosg_predict_p sosg_predict_init(const char *path)
+sosg_predict_p sosg_predict_init(const char *path, int huge)
 {
     sosg_predict_p predict = calloc(1, sizeof(sosg_predict_t));
     if (predict) {
         if (path) predict->path = strdup(path);
         
-        predict->update_lock = SDL_CreateMutex();
+        int i;
+        predict->free_slots = sosg_queue_init(PREDICT_SLOTS, sizeof(SDL_Surface *));
+        predict->ready_slots = sosg_queue_init(PREDICT_SLOTS, sizeof(SDL_Surface *));
         predict->client_lock = SDL_CreateMutex();
         predict->client_timeout = SDL_CreateCond();
         
@@ -336,17 +350,24 @@ sosg_predict_p sosg_predict_init(const char *path)
         predict->font = TTF_OpenFont("orbitron-black.otf", 32);
         
         SDL_Surface *surface = IMG_Load(predict->path);
-        if (surface) {
-            predict->buffer = SDL_CreateRGBSurface(SDL_SWSURFACE, surface->w, 
-                surface->h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-            predict->update_surf = SDL_CreateRGBSurface(SDL_SWSURFACE, surface->w, 
-                surface->h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+        if (surface && predict->free_slots && predict->ready_slots) {
             predict->path_surf = SDL_CreateRGBSurface(SDL_SWSURFACE, surface->w, 
                 surface->h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-            SDL_BlitSurface(surface, NULL, predict->buffer, NULL);
-            SDL_BlitSurface(surface, NULL, predict->update_surf, NULL);
             SDL_BlitSurface(surface, NULL, predict->path_surf, NULL);
+            predict->pool = sosg_pool_init((size_t)surface->w*surface->h*4, 0, huge);
+            for (i = 0; i < PREDICT_SLOTS; i++) {
+                predict->slots[i] = sosg_pool_create_surface(predict->pool, surface->w,
+                    surface->h);
+                if (!predict->slots[i]) break;
+                SDL_BlitSurface(surface, NULL, predict->slots[i], NULL);
+                // Show the map before the first satellite positions come in
+                if (i == 0) sosg_queue_push(predict->ready_slots, predict->slots + i);
+                else sosg_queue_push(predict->free_slots, predict->slots + i);
+            }
             SDL_FreeSurface(surface);
+            predict->frame.format = SOSG_FRAME_BGRA;
+            predict->frame.w = predict->path_surf->w;
+            predict->frame.h = predict->path_surf->h;
         } else {
             fprintf(stderr, "Warning: Could not open image at %s\n", predict->path);
         }
@@ -376,10 +397,13 @@ void sosg_predict_destroy(sosg_predict_p predict)
     
         if (predict->path) free(predict->path);
         if (predict->font) TTF_CloseFont(predict->font);
-        if (predict->buffer) SDL_FreeSurface(predict->buffer);
-        if (predict->update_surf) SDL_FreeSurface(predict->update_surf);
+        for (i = 0; i < PREDICT_SLOTS; i++) {
+            sosg_pool_free_surface(predict->slots[i]);
+        }
+        sosg_pool_destroy(predict->pool);
         if (predict->path_surf) SDL_FreeSurface(predict->path_surf);
-        if (predict->update_lock) SDL_DestroyMutex(predict->update_lock);
+        sosg_queue_destroy(predict->free_slots);
+        sosg_queue_destroy(predict->ready_slots);
         if (predict->client_lock) SDL_DestroyMutex(predict->client_lock);
         if (predict->client_timeout) SDL_DestroyCond(predict->client_timeout);
         for (i = 0; i < predict->num_sats; i++) {
@@ -396,23 +420,32 @@ void sosg_predict_destroy(sosg_predict_p predict)
 
 void sosg_predict_get_resolution(sosg_predict_p predict, int *resolution)
 {
-    if (resolution && predict && predict->buffer) {
-        resolution[0] = predict->buffer->w;
-        resolution[1] = predict->buffer->h;
+    if (resolution && predict && predict->path_surf) {
+        resolution[0] = predict->path_surf->w;
+        resolution[1] = predict->path_surf->h;
     }
 }
 
-SDL_Surface *sosg_predict_update(sosg_predict_p predict)
+sosg_frame_p sosg_predict_update(sosg_predict_p predict)
 {
+    SDL_Surface *surface;
+    SDL_Surface *latest = NULL;
+
     if (!predict) return NULL;
     
-    // We only blit the surface if it was changed by the predict client thread
-    SDL_mutexP(predict->update_lock);
-    if (predict->should_update) {
-        SDL_BlitSurface(predict->update_surf, NULL, predict->buffer, NULL);
-        predict->should_update = 0;
+    // We only pass a frame if it was changed by the predict client thread
+    while (!sosg_queue_pop(predict->ready_slots, &surface)) {
+        if (latest) sosg_queue_push(predict->free_slots, &latest);
+        latest = surface;
     }
-    SDL_mutexV(predict->update_lock);
+    if (!latest) return NULL;
+    
+    // Hold on to the shown slot until there is a newer one, since the
+    // software renderer keeps drawing from it
+    if (predict->current) sosg_queue_push(predict->free_slots, &predict->current);
+    predict->current = latest;
+    predict->frame.surface = latest;
+    predict->frame.overlaid = 0;
     
-    return predict->buffer;
+    return &predict->frame;
 }
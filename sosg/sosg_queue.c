@@ -0,0 +1,131 @@
+/*
+Filename:     sosg_queue.c
+Content:      Lock-free frame handoff for Science on a Snow Globe
+Authors:      Nirav Patel
+Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
+
+    Permission to use, copy, modify, and/or distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "sosg_queue.h"
+#include <stdio.h>
+#include <string.h>
+
+// head is only written by the producer and tail only by the consumer.  Both
+// count up forever and wrap naturally, and the capacity is a power of two so
+// that head - tail is the number of queued items even across the wrap.
+
+typedef struct sosg_queue_struct {
+    SDL_atomic_t head;
+    // Keep the two indices on separate cache lines so the producer and
+    // consumer don't bounce one line between them on every item
+    char pad[64 - sizeof(SDL_atomic_t)];
+    SDL_atomic_t tail;
+    int capacity;
+    int item_size;
+    uint8_t *items;
+} sosg_queue_t;
+
+sosg_queue_p sosg_queue_init(int capacity, int item_size)
+{
+    int size = 1;
+    sosg_queue_p queue;
+
+    if (capacity < 1 || item_size < 1) return NULL;
+    while (size < capacity) size <<= 1;
+
+    queue = calloc(1, sizeof(sosg_queue_t));
+    if (queue) {
+        queue->capacity = size;
+        queue->item_size = item_size;
+        queue->items = malloc(size*item_size);
+        if (!queue->items) {
+            fprintf(stderr, "Error: Could not allocate a queue of %d items\n", size);
+            free(queue);
+            return NULL;
+        }
+        SDL_AtomicSet(&queue->head, 0);
+        SDL_AtomicSet(&queue->tail, 0);
+    }
+
+    return queue;
+}
+
+void sosg_queue_destroy(sosg_queue_p queue)
+{
+    if (queue) {
+        if (queue->items) free(queue->items);
+        free(queue);
+    }
+}
+
+int sosg_queue_push(sosg_queue_p queue, const void *item)
+{
+    int head = SDL_AtomicGet(&queue->head);
+    int tail = SDL_AtomicGet(&queue->tail);
+    // Order reading the tail before overwriting the slot it just released
+    SDL_MemoryBarrierAcquire();
+
+    if (head - tail >= queue->capacity) return -1;
+
+    memcpy(queue->items + (head & (queue->capacity-1))*queue->item_size, item,
+        queue->item_size);
+    // Publish the item before the index that makes it visible
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->head, head + 1);
+
+    return 0;
+}
+
+int sosg_queue_pop(sosg_queue_p queue, void *item)
+{
+    int tail = SDL_AtomicGet(&queue->tail);
+    int head = SDL_AtomicGet(&queue->head);
+    // Order reading the head before reading the item it published
+    SDL_MemoryBarrierAcquire();
+
+    if (head == tail) return -1;
+
+    memcpy(item, queue->items + (tail & (queue->capacity-1))*queue->item_size,
+        queue->item_size);
+    // Finish reading the slot before handing it back to the producer
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->tail, tail + 1);
+
+    return 0;
+}
+
+// Copy out the next item without taking it, which only the consumer may do
+int sosg_queue_peek(sosg_queue_p queue, void *item)
+{
+    int tail = SDL_AtomicGet(&queue->tail);
+    int head = SDL_AtomicGet(&queue->head);
+    SDL_MemoryBarrierAcquire();
+
+    if (head == tail) return -1;
+
+    memcpy(item, queue->items + (tail & (queue->capacity-1))*queue->item_size,
+        queue->item_size);
+
+    return 0;
+}
+
+int sosg_queue_pop_latest(sosg_queue_p queue, void *item)
+{
+    // Skip straight to the newest item, for consumers that only care about
+    // the current state rather than every step along the way
+    if (sosg_queue_pop(queue, item)) return -1;
+    while (!sosg_queue_pop(queue, item));
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef _SOSG_QUEUE_H_
+#define _SOSG_QUEUE_H_
+
+#include "SDL.h"
+
+// A lock-free queue between exactly one producer thread and one consumer
+// thread.  Items are copied in and out by value, so it can carry frame
+// pointers as well as small structs like tracker samples.  Neither side ever
+// waits on the other; push fails when the queue is full and pop fails when it
+// is empty.
+
+typedef struct sosg_queue_struct *sosg_queue_p;
+
+sosg_queue_p sosg_queue_init(int capacity, int item_size);
+void sosg_queue_destroy(sosg_queue_p queue);
+int sosg_queue_push(sosg_queue_p queue, const void *item);
+int sosg_queue_pop(sosg_queue_p queue, void *item);
+int sosg_queue_peek(sosg_queue_p queue, void *item);
+int sosg_queue_pop_latest(sosg_queue_p queue, void *item);
+
+#endif /* _SOSG_QUEUE_H_ */
@@ -0,0 +1,305 @@
+/*
+Filename:     sosg_soft.c
+Content:      Software renderer for Science on a Snow Globe
+Authors:      Nirav Patel
+Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
+
+    Permission to use, copy, modify, and/or distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "sosg_soft.h"
+#include <stdio.h>
+#include <math.h>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif /* __SSE2__ */
+
+// The same mapping as sosg.frag, but done on the CPU for machines without a
+// usable OpenGL driver.  Since only the rotation changes between frames, the
+// mapping is computed once per pixel and each frame is just a remap of the
+// source with the same 5 tap filter as the shader.
+
+typedef struct worker_struct {
+    sosg_soft_p soft;
+    SDL_Thread *thread;
+    SDL_sem *start;
+    int first;
+    int last;
+} worker_t, *worker_p;
+
+typedef struct sosg_soft_struct {
+    int w;
+    int h;
+    float *map;
+    int running;
+    int num_workers;
+    worker_p workers;
+    SDL_sem *done;
+
+    // The frame currently being rendered, only touched by the workers
+    // between the start and done semaphores
+    SDL_Surface *source;
+    float shift;
+    uint8_t *pixels;
+    int pitch;
+} sosg_soft_t;
+
+static inline int wrap(int a, int n)
+{
+    // Coordinates are at most a couple of texels out of range
+    while (a < 0) a += n;
+    while (a >= n) a -= n;
+    return a;
+}
+
+#ifdef __SSE2__
+// Bilinear sample at x, y in 24.8 fixed point texels, leaving the four
+// channels in the low 16 bit lanes
+static inline __m128i bilinear(const uint32_t *texels, int pitch, int tw, int th, int x, int y)
+{
+    int fx = x & 0xFF;
+    int fy = y & 0xFF;
+    int x0 = wrap(x >> 8, tw);
+    int x1 = wrap((x >> 8) + 1, tw);
+    const uint32_t *r0 = texels + wrap(y >> 8, th)*pitch;
+    const uint32_t *r1 = texels + wrap((y >> 8) + 1, th)*pitch;
+    __m128i zero = _mm_setzero_si128();
+
+    // Left texel in the low half, right texel in the high half
+    __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(r0[x0]),
+                                    _mm_cvtsi32_si128(r0[x1])), zero);
+    __m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(r1[x0]),
+                                       _mm_cvtsi32_si128(r1[x1])), zero);
+
+    // Everything fits in unsigned 16 bits since 255*256 < 65536
+    __m128i col = _mm_srli_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(top, _mm_set1_epi16(256 - fy)),
+        _mm_mullo_epi16(bottom, _mm_set1_epi16(fy))), 8);
+    __m128i row = _mm_mullo_epi16(col, _mm_set_epi16(fx, fx, fx, fx,
+        256 - fx, 256 - fx, 256 - fx, 256 - fx));
+    return _mm_srli_epi16(_mm_add_epi16(row, _mm_srli_si128(row, 8)), 8);
+}
+
+static inline uint32_t filter(const uint32_t *texels, int pitch, int tw, int th, int x, int y)
+{
+    // A really naive filter to reduce sparkling, the same as the shader
+    __m128i sum = _mm_slli_epi16(bilinear(texels, pitch, tw, th, x, y), 2);
+    sum = _mm_add_epi16(sum, bilinear(texels, pitch, tw, th, x - 256, y));
+    sum = _mm_add_epi16(sum, bilinear(texels, pitch, tw, th, x + 256, y));
+    sum = _mm_add_epi16(sum, bilinear(texels, pitch, tw, th, x, y - 256));
+    sum = _mm_add_epi16(sum, bilinear(texels, pitch, tw, th, x, y + 256));
+    sum = _mm_srli_epi16(sum, 3);
+    return _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+}
+#else
+static inline void bilinear(const uint32_t *texels, int pitch, int tw, int th, int x, int y, int *out)
+{
+    int c;
+    int fx = x & 0xFF;
+    int fy = y & 0xFF;
+    int x0 = wrap(x >> 8, tw);
+    int x1 = wrap((x >> 8) + 1, tw);
+    const uint8_t *r0 = (const uint8_t *)(texels + wrap(y >> 8, th)*pitch);
+    const uint8_t *r1 = (const uint8_t *)(texels + wrap((y >> 8) + 1, th)*pitch);
+
+    for (c = 0; c < 4; c++) {
+        int left = (r0[x0*4+c]*(256 - fy) + r1[x0*4+c]*fy) >> 8;
+        int right = (r0[x1*4+c]*(256 - fy) + r1[x1*4+c]*fy) >> 8;
+        out[c] += (left*(256 - fx) + right*fx) >> 8;
+    }
+}
+
+static inline uint32_t filter(const uint32_t *texels, int pitch, int tw, int th, int x, int y)
+{
+    int c;
+    int center[4] = {0, 0, 0, 0};
+    int sum[4] = {0, 0, 0, 0};
+    uint32_t color = 0;
+
+    bilinear(texels, pitch, tw, th, x, y, center);
+    bilinear(texels, pitch, tw, th, x - 256, y, sum);
+    bilinear(texels, pitch, tw, th, x + 256, y, sum);
+    bilinear(texels, pitch, tw, th, x, y - 256, sum);
+    bilinear(texels, pitch, tw, th, x, y + 256, sum);
+
+    for (c = 0; c < 4; c++) {
+        ((uint8_t *)&color)[c] = (center[c]*4 + sum[c]) >> 3;
+    }
+    return color;
+}
+#endif /* __SSE2__ */
+
+static void render_rows(sosg_soft_p soft, int first, int last)
+{
+    int i, j;
+    SDL_Surface *source = soft->source;
+    const uint32_t *texels = source->pixels;
+    int pitch = source->pitch/4;
+    float tw = (float)source->w;
+    float th = (float)source->h;
+
+    for (j = first; j < last; j++) {
+        const float *map = soft->map + j*soft->w*2;
+        uint32_t *out = (uint32_t *)(soft->pixels + j*soft->pitch);
+        for (i = 0; i < soft->w; i++) {
+            float u = map[i*2] + soft->shift;
+            float v = map[i*2+1];
+            if (v < 0.0) {
+                out[i] = 0;
+                continue;
+            }
+            u -= floorf(u);
+            // Texel centers are at half coordinates, like GL_LINEAR
+            int x = (int)floorf((u*tw - 0.5)*256.0);
+            int y = (int)floorf((v*th - 0.5)*256.0);
+            out[i] = filter(texels, pitch, source->w, source->h, x, y);
+        }
+    }
+}
+
+static int sosg_soft_work(void *data)
+{
+    worker_p worker = (worker_p)data;
+    sosg_soft_p soft = worker->soft;
+
+    while (1) {
+        SDL_SemWait(worker->start);
+        if (!soft->running) break;
+        render_rows(soft, worker->first, worker->last);
+        SDL_SemPost(soft->done);
+    }
+
+    return 0;
+}
+
+static void build_map(sosg_soft_p soft, float ratio, float radius, float height,
+                      float *center, int mirror)
+{
+    int i, j;
+
+    // Evaluate the fisheye mapping of sosg.frag at the center of every pixel,
+    // leaving out the rotation and flagging pixels off the globe
+    for (j = 0; j < soft->h; j++) {
+        for (i = 0; i < soft->w; i++) {
+            float *m = soft->map + (j*soft->w + i)*2;
+            float s = ((float)i + 0.5)/(float)soft->w;
+            if (mirror) s = 1.0 - s;
+            float x = (s - center[0])*ratio;
+            float y = ((float)j + 0.5)/(float)soft->h - center[1];
+            float d = sqrt(x*x + y*y);
+            float h = d*M_SQRT1_2/radius;
+            float theta = asin(height*h/radius) + asin(h);
+            if (d > radius || isnan(theta)) {
+                m[0] = 0.0;
+                m[1] = -1.0;
+            } else {
+                m[0] = -atan2(x, y)/(2.0*M_PI);
+                m[1] = theta/M_PI_2;
+            }
+        }
+    }
+}
+
+sosg_soft_p sosg_soft_init(int w, int h, float ratio, float radius, float height,
+                           float *center, int mirror, int num_threads)
+{
+    int i;
+    sosg_soft_p soft;
+
+    if (w < 1 || h < 1) return NULL;
+
+    soft = calloc(1, sizeof(sosg_soft_t));
+    if (soft) {
+        soft->w = w;
+        soft->h = h;
+        soft->map = malloc(w*h*2*sizeof(float));
+        if (!soft->map) {
+            fprintf(stderr, "Error: Could not allocate the software renderer map\n");
+            free(soft);
+            return NULL;
+        }
+        build_map(soft, ratio, radius, height, center, mirror);
+
+        if (num_threads < 1) num_threads = 1;
+        if (num_threads > h) num_threads = h;
+        soft->workers = calloc(num_threads, sizeof(worker_t));
+        soft->done = SDL_CreateSemaphore(0);
+        soft->running = 1;
+
+        // Split the rows evenly across the workers
+        for (i = 0; i < num_threads; i++) {
+            worker_p worker = soft->workers + i;
+            worker->soft = soft;
+            worker->first = i*h/num_threads;
+            worker->last = (i+1)*h/num_threads;
+            worker->start = SDL_CreateSemaphore(0);
+            worker->thread = SDL_CreateThread(sosg_soft_work, "Render thread", worker);
+            if (!worker->thread) {
+                fprintf(stderr, "Warning: Could not create render thread: %s\n", SDL_GetError());
+                SDL_DestroySemaphore(worker->start);
+                break;
+            }
+            soft->num_workers++;
+        }
+
+        // Make sure whatever workers we did get cover every row
+        if (soft->num_workers) {
+            soft->workers[soft->num_workers-1].last = h;
+        } else {
+            sosg_soft_destroy(soft);
+            return NULL;
+        }
+    }
+
+    return soft;
+}
+
+void sosg_soft_destroy(sosg_soft_p soft)
+{
+    int i;
+    if (soft) {
+        soft->running = 0;
+        for (i = 0; i < soft->num_workers; i++) {
+            SDL_SemPost(soft->workers[i].start);
+            SDL_WaitThread(soft->workers[i].thread, NULL);
+            SDL_DestroySemaphore(soft->workers[i].start);
+        }
+        if (soft->workers) free(soft->workers);
+        if (soft->done) SDL_DestroySemaphore(soft->done);
+        if (soft->map) free(soft->map);
+        free(soft);
+    }
+}
+
+void sosg_soft_render(sosg_soft_p soft, SDL_Surface *source, float rotation,
+                      void *pixels, int pitch)
+{
+    int i;
+
+    if (!soft || !source) return;
+
+    soft->source = source;
+    soft->shift = rotation/(2.0*M_PI);
+    soft->shift -= floorf(soft->shift);
+    soft->pixels = pixels;
+    soft->pitch = pitch;
+
+    // The semaphores order the job setup above before the workers read it
+    for (i = 0; i < soft->num_workers; i++) {
+        SDL_SemPost(soft->workers[i].start);
+    }
+    for (i = 0; i < soft->num_workers; i++) {
+        SDL_SemWait(soft->done);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef _SOSG_SOFT_H_
+#define _SOSG_SOFT_H_
+
+#include "SDL.h"
+
+typedef struct sosg_soft_struct *sosg_soft_p;
+
+sosg_soft_p sosg_soft_init(int w, int h, float ratio, float radius, float height,
+                           float *center, int mirror, int num_threads);
+void sosg_soft_destroy(sosg_soft_p soft);
+void sosg_soft_render(sosg_soft_p soft, SDL_Surface *source, float rotation,
+                      void *pixels, int pitch);
+
+#endif /* _SOSG_SOFT_H_ */
@@ -18,6 +18,8 @@ Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
 */
 
 #include "sosg_tracker.h"
+#include "sosg_event.h"
+#include "sosg_queue.h"
 #include "SDL.h"
 #include <stdio.h>
 #include <fcntl.h>
@@ -67,14 +69,28 @@ typedef struct packet_s {
 #define PACKET_MAX_SIZE (sizeof(unsigned char)+sizeof(float)*4)
 #define PACKET_MAX_READ (4096)
 
+// Samples queued between the read thread and the main loop
+#define TRACKER_QUEUE 64
+
+typedef struct sample_struct {
+    float rotation;
+    int mode;
+} sample_t;
+
 typedef struct sosg_tracker_struct {
     int fd;
     SDL_Thread *read_thread;
     int running;
+    // Only touched by the read thread
     int mode;
     float rotation;
     float scroll_last;
     float scroll_rotation;
+    int unsent;
+    // The rotation and mode are published together so the main loop never
+    // sees one from a different packet than the other
+    sosg_queue_p samples;
+    sample_t current;
 } sosg_tracker_t;
 
 static int pack_seq(unsigned char *buf, int len, unsigned char *out)
@@ -171,6 +187,18 @@ static void tracker_update(sosg_tracker_p tracker, packet_p packet)
 //    printf("%f %f %f %d %f\n", roll, pitch, mode_angle, tracker->mode, tracker->rotation);
 }
 
+static void tracker_publish(sosg_tracker_p tracker)
+{
+    sample_t sample;
+    sample.rotation = tracker->rotation;
+    sample.mode = tracker->mode;
+
+    // If the main loop has fallen far behind, hold on to the sample and try
+    // again later rather than waiting for it
+    tracker->unsent = sosg_queue_push(tracker->samples, &sample) != 0;
+    if (!tracker->unsent) sosg_event_wake();
+}
+
 static int tracker_parse(packet_p packet, unsigned char *buf, int len)
 {
     int i;
@@ -211,6 +239,7 @@ static int tracker_read(void *data)
         FD_SET(tracker->fd, &set);
         // read is set to be non-blocking, so wait on the fd with a timeout
         select(tracker->fd+1, &set, NULL, NULL, &timeout);
+        if (tracker->unsent) tracker_publish(tracker);
         // Read available bytes one at a time and unSLIP them into the buffer
         while (1) {
             unsigned char readbuf[PACKET_MAX_READ];
@@ -223,6 +252,7 @@ static int tracker_read(void *data)
                     case END:
                         if (tracker_parse(&packet, buf, len)) {
                             tracker_update(tracker, &packet);
+                            tracker_publish(tracker);
                         }
                         len = 0;
                         break;
@@ -266,6 +296,14 @@ sosg_tracker_p sosg_tracker_init(const char *device)
             return NULL;
         }
         
+        tracker->samples = sosg_queue_init(TRACKER_QUEUE, sizeof(sample_t));
+        if (!tracker->samples) {
+            close(tracker->fd);
+            free(tracker);
+            return NULL;
+        }
+        tracker->current.mode = tracker->mode;
+        
         tracker->running = 1;
         tracker->read_thread = SDL_CreateThread(tracker_read, "Read thread", tracker);
     }
@@ -279,6 +317,7 @@ void sosg_tracker_destroy(sosg_tracker_p tracker)
         tracker->running = 0;
         if (tracker->read_thread) SDL_WaitThread(tracker->read_thread, NULL);
         close(tracker->fd);
+        sosg_queue_destroy(tracker->samples);
         
         free(tracker);
     }
@@ -287,8 +326,10 @@ void sosg_tracker_destroy(sosg_tracker_p tracker)
 void sosg_tracker_get_rotation(sosg_tracker_p tracker, float *rotation, int *mode)
 {
     if (tracker) {
-        if (rotation) *rotation = tracker->rotation;
-        if (mode) *mode = tracker->mode;
+        // Only the newest sample matters, the rest are already out of date
+        sosg_queue_pop_latest(tracker->samples, &tracker->current);
+        if (rotation) *rotation = tracker->current.rotation;
+        if (mode) *mode = tracker->current.mode;
     }
 }
 
@@ -1,57 +1,418 @@
 /* Based on http://wiki.videolan.org/LibVLC_SampleCode_SDL */
 
 #include "sosg_video.h"
+#include "sosg_event.h"
+#include "sosg_queue.h"
+#include "sosg_pool.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <vlc/vlc.h>
 
-// TODO: Make the size dynamic based on input resolution
-#define VIDEOWIDTH 2048
-#define VIDEOHEIGHT 1024
+// Videos are decoded at their own size, up to this on a side, past which
+// VLC scales them down
+#define MAX_VIDEO_SIZE 16384
+#define VIDEO_POOLS 4 // frame sizes to keep pools for, as playlist items change
 
-typedef struct sosg_video_struct {
-    SDL_Surface *buffer;
+// VLC decodes straight into one of a handful of slots, which are then passed
+// to the main loop by pointer instead of being copied under a lock.  VLC
+// calls lock and unlock from its decoder thread and display from its output
+// thread, so each slot's state is an atomic that both sides claim it through,
+// and displayed slots are handed to the main loop through a queue.
+#define VIDEO_SLOTS SOSG_VIDEO_SLOTS
+#define VIDEO_SCRATCH 15
+
+// While scrubbing, the frames VLC decoded at the times scrubbed to are kept,
+// so going back over them doesn't have to wait on a seek
+#define SCRUB_FRAMES 8
+#define SEEK_TIMEOUT 250 // milliseconds to wait for a seek to show a frame
+
+// A slot's state is its kind in the low bits and a generation above them,
+// which is also baked into the picture identifier given to VLC.  That way a
+// late display of a slot that has since been reclaimed can't publish it.
+#define SLOT_STATE(gen, kind) ((((gen) & 0xFFFFF) << 2) | (kind))
+#define SLOT_GEN(state) ((state) >> 2)
+#define SLOT_KIND(state) ((state) & 3)
+#define SLOT_ID(gen, index) ((void *)(uintptr_t)((((gen) & 0xFFFFF) << 4) | (index)))
+#define SLOT_ID_GEN(id) ((int)((uintptr_t)(id) >> 4))
+#define SLOT_ID_INDEX(id) ((int)((uintptr_t)(id) & 0xF))
+
+// The size and chroma VLC decodes at, as set by the format callback on one
+// of its threads, packed into one atomic so it's never read half updated
+#define FORMAT(w, h, planar) ((int)((planar) << 30 | (w) << 15 | (h)))
+#define FORMAT_W(format) (((format) >> 15) & 0x7FFF)
+#define FORMAT_H(format) ((format) & 0x7FFF)
+#define FORMAT_PLANAR(format) ((format) >> 30)
+
+enum slot_kind {
+    SLOT_FREE,   // Can be claimed by lock
+    SLOT_LOCKED, // VLC is decoding into it or has yet to display it
+    SLOT_QUEUED  // Displayed, and owned by the main loop from then on
+};
+
+typedef struct slot_struct {
+    // What VLC decodes into, laid out for format, with a surface around it
+    // for 32 bit formats
+    uint8_t *pixels;
+    sosg_pool_p pool; // pixels came from, or NULL if malloc'd or the renderer's
+    int format;
     SDL_Surface *surface;
-    SDL_mutex *mutex;
+    SDL_atomic_t state;
+    SDL_atomic_t locked_at;
+    // Set by display before the slot is queued
+    uint32_t seq;
+    uint64_t pts;
+    int overlaid; // only kept for the scrub cache, which can be shown again
+} slot_t, *slot_p;
+
+typedef struct sosg_video_struct {
+    slot_t slots[VIDEO_SLOTS];
+    // Decoded into when every slot is in use, and never shown
+    slot_t scratch;
+    SDL_atomic_t locks;
+    SDL_atomic_t format;
+    // The largest frames the renderer takes as planar YUV, or 0 for BGRA only
+    SDL_atomic_t max_planar;
+    slot_p current;
+    sosg_queue_p ready;
+    uint32_t displayed; // only touched by VLC's output thread
+    // The main loop's view of the display, to time frames to
+    uint64_t vsync;
+    uint64_t period;
+    uint32_t last_seq;
+    int shown;
+    int skipped;
+    int huge;
+    // Given by the renderer, like a mapped pixel buffer, for the slots to
+    // be decoded straight into
+    void *memory;
+    size_t frame_size;
+    // Only touched by VLC's decoder thread, which is the one that allocates
+    int num_pools;
+    sosg_pool_p pools[VIDEO_POOLS];
+    sosg_frame_t frame;
     libvlc_instance_t *libvlc;
     libvlc_media_list_t *ml;
     libvlc_media_list_player_t *mlp;
     libvlc_media_player_t *mp;
     int num_videos;
+    int index;
+    // Scrubbing, only touched by the main loop, except that the decoder
+    // checks whether it is going on
+    SDL_atomic_t scrubbing;
+    float fps;
+    int64_t origin; // the time at a scrub position of 0
+    int64_t target; // the time scrubbed to
+    int64_t seek_time; // of the seek VLC is working on, or -1
+    uint64_t seek_at;
+    int64_t next_seek; // to start once it's done, or -1
+    slot_t cache[SCRUB_FRAMES];
+    int64_t cache_time[SCRUB_FRAMES]; // or -1 if the entry is unused
+    int cached; // entry to show next, or -1
+    int showing; // entry on screen, or -1
 } sosg_video_t;
 
+static slot_p get_slot(sosg_video_p video, void *id)
+{
+    int index = SLOT_ID_INDEX(id);
+    return index == VIDEO_SCRATCH ? &video->scratch : &video->slots[index];
+}
+
+// The pitch and number of lines of each plane of a format, and the bytes they
+// take together.  Planar frames are I420, a full resolution plane of luma and
+// two of chroma at half resolution, with rows padded for VLC's SIMD.
+static size_t layout(int format, unsigned *pitches, unsigned *lines)
+{
+    unsigned w = FORMAT_W(format);
+    unsigned h = FORMAT_H(format);
+
+    if (!FORMAT_PLANAR(format)) {
+        pitches[0] = w*4;
+        lines[0] = h;
+        return (size_t)pitches[0]*lines[0];
+    }
+
+    pitches[0] = (w + 31) & ~31;
+    pitches[1] = pitches[2] = pitches[0]/2;
+    lines[0] = h;
+    lines[1] = lines[2] = (h + 1)/2;
+    return (size_t)pitches[0]*lines[0] + 2*(size_t)pitches[1]*lines[1];
+}
+
+// The pool for frames of size bytes, or NULL once there have been too many
+// sizes for pools to be worth it
+static sosg_pool_p get_pool(sosg_video_p video, size_t size)
+{
+    int i;
+
+    for (i = 0; i < video->num_pools; i++) {
+        if (sosg_pool_get_block_size(video->pools[i]) == size) return video->pools[i];
+    }
+    if (video->num_pools == VIDEO_POOLS) return NULL;
+
+    // Page aligned so VLC can write them with aligned stores
+    sosg_pool_p pool = sosg_pool_init(size, 0, video->huge);
+    if (pool) video->pools[video->num_pools++] = pool;
+    return pool;
+}
+
+// Whether pixels are in the renderer's memory rather than our own
+static int is_mapped(sosg_video_p video, const uint8_t *pixels)
+{
+    uint8_t *memory = SDL_AtomicGetPtr(&video->memory);
+    return memory && pixels >= memory && pixels < memory + VIDEO_SLOTS*video->frame_size;
+}
+
+static void free_slot(sosg_video_p video, slot_p slot)
+{
+    SDL_FreeSurface(slot->surface);
+    if (slot->pool) {
+        sosg_pool_free(slot->pool, slot->pixels);
+    } else if (!is_mapped(video, slot->pixels)) {
+        free(slot->pixels);
+    }
+    slot->surface = NULL;
+    slot->pixels = NULL;
+    slot->pool = NULL;
+}
+
+// Give an empty slot pixels for format, which are the ones given, or else
+// from the pool, if there is one, or the heap
+static void alloc_slot(slot_p slot, int format, uint8_t *pixels, sosg_pool_p pool)
+{
+    unsigned pitches[3], lines[3];
+    size_t size = layout(format, pitches, lines);
+
+    slot->format = format;
+    if (!pixels) {
+        pixels = pool ? sosg_pool_alloc(pool) : NULL;
+        if (pixels) slot->pool = pool;
+        else pixels = malloc(size);
+    }
+    slot->pixels = pixels;
+
+    if (pixels && !FORMAT_PLANAR(format)) {
+        // Without userdata, freeing it leaves the pixels alone
+        slot->surface = SDL_CreateRGBSurfaceFrom(pixels, FORMAT_W(format),
+            FORMAT_H(format), 32, pitches[0],
+            0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    }
+}
+
+// Where the pixels of a slot for format go, which is the renderer's memory if
+// it has given us some the frame fits in, or NULL for our own.  While
+// scrubbing, frames are copied to be kept, and the renderer's memory is only
+// for writing to, so they go in our own instead.
+static uint8_t *slot_memory(sosg_video_p video, int format, int index)
+{
+    unsigned pitches[3], lines[3];
+    size_t size = layout(format, pitches, lines);
+    uint8_t *memory = SDL_AtomicGetPtr(&video->memory);
+
+    if (memory && index != VIDEO_SCRATCH && size <= video->frame_size &&
+        !SDL_AtomicGet(&video->scrubbing)) {
+        return memory + index*video->frame_size;
+    }
+    return NULL;
+}
+
+// Whether a slot's pixels are already right for the current format
+static int slot_fits(sosg_video_p video, slot_p slot, int index)
+{
+    int format = SDL_AtomicGet(&video->format);
+    uint8_t *pixels = slot_memory(video, format, index);
+
+    return slot->pixels && slot->format == format &&
+           (pixels ? slot->pixels == pixels : !is_mapped(video, slot->pixels));
+}
+
+// Make sure the pixels of a slot we own match the current format.  Slots are
+// replaced as they come around to be decoded into again, since the main loop
+// may still be showing one of the old format.
+static void fit_slot(sosg_video_p video, slot_p slot, int index)
+{
+    int format = SDL_AtomicGet(&video->format);
+    unsigned pitches[3], lines[3];
+    size_t size = layout(format, pitches, lines);
+    uint8_t *pixels = slot_memory(video, format, index);
+
+    if (slot_fits(video, slot, index)) return;
+
+    free_slot(video, slot);
+    alloc_slot(slot, format, pixels, pixels ? NULL : get_pool(video, size));
+}
+
+static void *claim(sosg_video_p video)
+{
+    int i, state;
+    int oldest = -1;
+    int stamp = SDL_AtomicAdd(&video->locks, 1);
+
+    for (i = 0; i < VIDEO_SLOTS; i++) {
+        state = SDL_AtomicGet(&video->slots[i].state);
+        if (SLOT_KIND(state) == SLOT_FREE &&
+            SDL_AtomicCAS(&video->slots[i].state, state, SLOT_STATE(SLOT_GEN(state), SLOT_LOCKED))) {
+            SDL_AtomicSet(&video->slots[i].locked_at, stamp);
+            return SLOT_ID(SLOT_GEN(state), i);
+        }
+        if (SLOT_KIND(state) == SLOT_LOCKED && (oldest < 0 ||
+            stamp - SDL_AtomicGet(&video->slots[i].locked_at) >
+            stamp - SDL_AtomicGet(&video->slots[oldest].locked_at))) {
+            oldest = i;
+        }
+    }
+
+    // VLC never says when it drops a picture without displaying it, so those
+    // slots stay locked.  Once they've run out, take back whichever has been
+    // locked the longest, which is almost certainly one of those.  It might
+    // still be decoding into it though, so it's only taken back if its pixels
+    // can stay right where they are.
+    if (oldest >= 0 && slot_fits(video, &video->slots[oldest], oldest)) {
+        state = SDL_AtomicGet(&video->slots[oldest].state);
+        if (SLOT_KIND(state) == SLOT_LOCKED &&
+            SDL_AtomicCAS(&video->slots[oldest].state, state,
+                          SLOT_STATE(SLOT_GEN(state) + 1, SLOT_LOCKED))) {
+            SDL_AtomicSet(&video->slots[oldest].locked_at, stamp);
+            return SLOT_ID(SLOT_GEN(state) + 1, oldest);
+        }
+    }
+
+    return SLOT_ID(0, VIDEO_SCRATCH);
+}
+
 static void *lock(void *data, void **p_pixels)
 {
     sosg_video_p video = data;
+    void *id = claim(video);
+    slot_p slot = get_slot(video, id);
+    unsigned pitches[3], lines[3];
 
-    SDL_LockMutex(video->mutex);
-    SDL_LockSurface(video->buffer);
-    *p_pixels = video->buffer->pixels;
-    return NULL; /* picture identifier, not needed here */
+    fit_slot(video, slot, SLOT_ID_INDEX(id));
+    if (!slot->pixels) {
+        fprintf(stderr, "Error: Could not allocate video frame\n");
+        p_pixels[0] = NULL;
+        return id;
+    }
+
+    if (slot->surface) SDL_LockSurface(slot->surface);
+    p_pixels[0] = slot->pixels;
+    if (FORMAT_PLANAR(slot->format)) {
+        layout(slot->format, pitches, lines);
+        p_pixels[1] = (uint8_t *)p_pixels[0] + pitches[0]*lines[0];
+        p_pixels[2] = (uint8_t *)p_pixels[1] + pitches[1]*lines[1];
+    }
+    return id; /* picture identifier */
 }
 
 static void unlock(void *data, void *id, void *const *p_pixels)
 {
     sosg_video_p video = data;
+    slot_p slot = get_slot(video, id);
 
-    SDL_UnlockSurface(video->buffer);
-    SDL_UnlockMutex(video->mutex);
+    if (slot->surface) SDL_UnlockSurface(slot->surface);
 }
 
 static void display(void *data, void *id)
 {
-    
+    sosg_video_p video = data;
+    int index = SLOT_ID_INDEX(id);
+    int gen = SLOT_ID_GEN(id);
+
+    if (index == VIDEO_SCRATCH) return;
+
+    // Only ever called from VLC's output thread, so it is the one producer
+    // for the queue.  There are never more slots queued than it holds, so the
+    // push can't fail.
+    if (SDL_AtomicCAS(&video->slots[index].state, SLOT_STATE(gen, SLOT_LOCKED),
+                      SLOT_STATE(gen, SLOT_QUEUED))) {
+        slot_p slot = video->slots + index;
+        // VLC calls this when the picture is due, so that is its time
+        slot->seq = ++video->displayed;
+        slot->pts = SDL_GetPerformanceCounter();
+        sosg_queue_push(video->ready, &slot);
+        sosg_event_wake();
+    }
+}
+
+// Called by VLC whenever the video's format is known or changes, like going
+// to the next item of the playlist
+static unsigned setup_format(void **opaque, char *chroma, unsigned *width,
+                             unsigned *height, unsigned *pitches, unsigned *lines)
+{
+    sosg_video_p video = *opaque;
+    unsigned w = *width;
+    unsigned h = *height;
+    int i;
+
+    if (!w || !h) return 0;
+
+    // Only shrink what no GPU could hold, keeping the aspect ratio
+    if (w > MAX_VIDEO_SIZE || h > MAX_VIDEO_SIZE) {
+        float scale = (float)MAX_VIDEO_SIZE/(float)SDL_max(w, h);
+        w = SDL_max((unsigned)(w*scale), 1);
+        h = SDL_max((unsigned)(h*scale), 1);
+    }
+
+    // Most videos are YUV, which is kept as it is for the GPU to convert,
+    // saving the conversion on the CPU and more than half of the upload.
+    // Otherwise VLC converts to the 32 bit BGRA all renderers take, but at
+    // the source's size instead of scaling it too.
+    int max = SDL_AtomicGet(&video->max_planar);
+    int planar = w <= (unsigned)max && h <= (unsigned)max;
+    int format = FORMAT(w, h, planar);
+
+    memcpy(chroma, planar ? "I420" : "RV32", 4);
+    *width = w;
+    *height = h;
+    layout(format, pitches, lines);
+    SDL_AtomicSet(&video->format, format);
+
+    // VLC has let go of every picture of the last format by the time it asks
+    // for a new one, so any slots it dropped without displaying are free now
+    for (i = 0; i < VIDEO_SLOTS; i++) {
+        int state = SDL_AtomicGet(&video->slots[i].state);
+        if (SLOT_KIND(state) == SLOT_LOCKED) {
+            SDL_AtomicCAS(&video->slots[i].state, state,
+                          SLOT_STATE(SLOT_GEN(state) + 1, SLOT_FREE));
+        }
+    }
+
+    return VIDEO_SLOTS;
+}
+
+static void cleanup_format(void *opaque)
+{
+    // The slots are replaced as they're used at the next format
 }
 
-sosg_video_p sosg_video_init(int num_paths, char *paths[])
+static void release(slot_p slot)
+{
+    // Only the main loop touches a queued slot, so nothing can race this
+    int state = SDL_AtomicGet(&slot->state);
+    SDL_AtomicSet(&slot->state, SLOT_STATE(SLOT_GEN(state), SLOT_FREE));
+}
+
+sosg_video_p sosg_video_init(int num_paths, char *paths[], int huge)
 {
     sosg_video_p video = calloc(1, sizeof(sosg_video_t));
     if (video) {
-        video->mutex = SDL_CreateMutex();
-            
-        video->buffer = SDL_CreateRGBSurface(SDL_SWSURFACE, VIDEOWIDTH, VIDEOHEIGHT, 32, 
-            0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-        video->surface = SDL_CreateRGBSurface(SDL_SWSURFACE, VIDEOWIDTH, VIDEOHEIGHT, 32, 
-            0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+        int i;
+        video->huge = huge;
+        // The frames themselves are allocated once VLC knows their size
+        video->ready = sosg_queue_init(VIDEO_SLOTS, sizeof(slot_p));
+        for (i = 0; i < VIDEO_SLOTS; i++) {
+            SDL_AtomicSet(&video->slots[i].state, SLOT_STATE(0, SLOT_FREE));
+        }
+        if (!video->ready) {
+            fprintf(stderr, "Error: Could not allocate video frames\n");
+            sosg_video_destroy(video);
+            return NULL;
+        }
+        video->frame.format = SOSG_FRAME_BGRA;
+        video->seek_time = video->next_seek = -1;
+        video->cached = video->showing = -1;
+        for (i = 0; i < SCRUB_FRAMES; i++) video->cache_time[i] = -1;
         
         char const *vlc_argv[] =
         {
@@ -70,7 +431,6 @@ sosg_video_p sosg_video_init(int num_paths, char *paths[])
         libvlc_media_list_player_set_media_player(video->mlp, video->mp);
         libvlc_media_list_player_set_media_list(video->mlp, video->ml);
         
-        int i;
         for (i = 0; i < num_paths; i++) {
             libvlc_media_t *m = libvlc_media_new_path(video->libvlc, paths[i]);
             if (m) {
@@ -84,7 +444,7 @@ sosg_video_p sosg_video_init(int num_paths, char *paths[])
         libvlc_media_list_player_set_playback_mode(video->mlp, mode);
         
         libvlc_video_set_callbacks(video->mp, lock, unlock, display, video);
-        libvlc_video_set_format(video->mp, "RV32", VIDEOWIDTH, VIDEOHEIGHT, VIDEOWIDTH*4);
+        libvlc_video_set_format_callbacks(video->mp, setup_format, cleanup_format);
         
         libvlc_media_list_player_play(video->mlp);
     }
@@ -94,6 +454,8 @@ sosg_video_p sosg_video_init(int num_paths, char *paths[])
 
 void sosg_video_destroy(sosg_video_p video)
 {
+    int i;
+
     if (video) {
         if (video->mp) {
             libvlc_media_player_stop(video->mp);
@@ -102,32 +464,330 @@ void sosg_video_destroy(sosg_video_p video)
         if (video->ml) libvlc_media_list_release(video->ml);
         if (video->mlp) libvlc_media_list_player_release(video->mlp);
         if (video->libvlc) libvlc_release(video->libvlc);
-        if (video->buffer) SDL_FreeSurface(video->buffer);
-        if (video->mutex) SDL_DestroyMutex(video->mutex);
+        for (i = 0; i < VIDEO_SLOTS; i++) free_slot(video, video->slots + i);
+        free_slot(video, &video->scratch);
+        for (i = 0; i < SCRUB_FRAMES; i++) free_slot(video, video->cache + i);
+        for (i = 0; i < video->num_pools; i++) sosg_pool_destroy(video->pools[i]);
+        sosg_queue_destroy(video->ready);
         free(video);
     }
 }
 
+// Memory for every slot to be decoded into from then on, frame_size bytes
+// each, which has to stay valid until the video is destroyed.  Formats that
+// don't fit go back to decoding into the pool.
+void sosg_video_set_memory(sosg_video_p video, uint8_t *memory, size_t frame_size)
+{
+    if (video) {
+        video->frame_size = frame_size;
+        SDL_AtomicSetPtr(&video->memory, memory);
+    }
+}
+
+// The largest frames the renderer can take as planar YUV, or 0 if it only
+// takes BGRA.  VLC has usually picked a format by the time the renderer is
+// set up, so the video is restarted if this changes it.
+void sosg_video_set_planar(sosg_video_p video, int max_size)
+{
+    if (video) {
+        SDL_AtomicSet(&video->max_planar, max_size);
+        int format = SDL_AtomicGet(&video->format);
+        if (format && !FORMAT_PLANAR(format) &&
+            FORMAT_W(format) <= max_size && FORMAT_H(format) <= max_size) {
+            libvlc_media_list_player_play_item_at_index(video->mlp, video->index);
+        }
+    }
+}
+
+// The last time a frame went on screen and the time between refreshes, so
+// frames can be put on the refresh they are due for
+void sosg_video_set_clock(sosg_video_p video, uint64_t vsync, uint64_t period)
+{
+    if (video) {
+        video->vsync = vsync;
+        video->period = period;
+    }
+}
+
+// The next refresh after now, extrapolated from the last one
+static uint64_t next_vsync(sosg_video_p video, uint64_t now)
+{
+    if (!video->period) return now;
+    uint64_t ticks = now > video->vsync ? (now - video->vsync)/video->period + 1 : 1;
+    return video->vsync + ticks*video->period;
+}
+
+// Whether a frame should go on the next refresh.  Those due in the half of
+// a refresh just before it wait for the one after, so which refresh a frame
+// lands on depends on its time rather than on how quickly the main loop got
+// to it, which is what makes the cadence uneven when they're close.
+static int is_due(sosg_video_p video, slot_p slot, uint64_t now)
+{
+    return slot->pts + video->period/2 <= next_vsync(video, now);
+}
+
+// Milliseconds until a waiting frame is due to be drawn, or -1 if there
+// isn't one
+int sosg_video_get_delay(sosg_video_p video)
+{
+    slot_p slot;
+
+    if (!video) return -1;
+    if (SDL_AtomicGet(&video->scrubbing) && video->cached >= 0) return 0;
+    if (sosg_queue_peek(video->ready, &slot)) return -1;
+
+    // Frames while scrubbing are shown as soon as they're there
+    if (SDL_AtomicGet(&video->scrubbing)) return 0;
+
+    // It has to be drawn after the refresh before the one it's due for
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (is_due(video, slot, now)) return 0;
+    uint64_t wake = next_vsync(video, now);
+    return (int)((wake - now)*1000/SDL_GetPerformanceFrequency()) + 1;
+}
+
+void sosg_video_get_stats(sosg_video_p video, int *shown, int *skipped)
+{
+    if (video) {
+        if (shown) *shown = video->shown;
+        if (skipped) *skipped = video->skipped;
+    }
+}
+
+// The size frames are decoded at, or 0 until VLC has opened the video, in
+// which case the renderer picks it up from the first frame
 void sosg_video_get_resolution(sosg_video_p video, int *resolution)
 {
-    if (resolution) {
-        resolution[0] = VIDEOWIDTH;
-        resolution[1] = VIDEOHEIGHT;
+    if (video && resolution) {
+        int format = SDL_AtomicGet(&video->format);
+        resolution[0] = FORMAT_W(format);
+        resolution[1] = FORMAT_H(format);
     }
 }
 
 void sosg_video_set_index(sosg_video_p video, int index)
 {
     if (video) {
-        libvlc_media_list_player_play_item_at_index(video->mlp, index%video->num_videos);
+        // The next item starts playing, so any scrubbing is over
+        SDL_AtomicSet(&video->scrubbing, 0);
+        video->index = (index%video->num_videos + video->num_videos)%video->num_videos;
+        libvlc_media_list_player_play_item_at_index(video->mlp, video->index);
+    }
+}
+
+static int find_cached(sosg_video_p video, int64_t time)
+{
+    int i;
+    for (i = 0; i < SCRUB_FRAMES; i++) {
+        if (video->cache_time[i] == time) return i;
+    }
+    return -1;
+}
+
+// Keep a copy of a frame VLC seeked to, in place of the one farthest from
+// where the video is scrubbed to now, but never the one on screen
+static void cache_slot(sosg_video_p video, slot_p slot, int64_t time)
+{
+    unsigned pitches[3], lines[3];
+    int i, best = find_cached(video, time);
+
+    // A frame decoded just before scrubbing started can still be in the
+    // renderer's memory, which can't be read back
+    if (is_mapped(video, slot->pixels)) return;
+    if (best >= 0 && best == video->showing) return;
+    for (i = 0; i < SCRUB_FRAMES && best < 0; i++) {
+        if (i != video->showing && video->cache_time[i] < 0) best = i;
+    }
+    if (best < 0) {
+        for (i = 0; i < SCRUB_FRAMES; i++) {
+            if (i == video->showing) continue;
+            if (best < 0 || llabs(video->cache_time[i] - video->target) >
+                            llabs(video->cache_time[best] - video->target)) best = i;
+        }
+    }
+
+    slot_p entry = video->cache + best;
+    if (entry->format != slot->format || !entry->pixels) {
+        free_slot(video, entry);
+        alloc_slot(entry, slot->format, NULL, NULL);
+    }
+    if (entry->pixels) {
+        memcpy(entry->pixels, slot->pixels, layout(slot->format, pitches, lines));
+        entry->overlaid = 0;
+        video->cache_time[best] = time;
+    } else {
+        video->cache_time[best] = -1;
     }
 }
 
-SDL_Surface *sosg_video_update(sosg_video_p video)
+static void seek(sosg_video_p video, int64_t time)
 {
-    SDL_LockMutex(video->mutex);
-    SDL_BlitSurface(video->buffer, NULL, video->surface, NULL);
-    SDL_UnlockMutex(video->mutex);
+    libvlc_media_player_set_time(video->mp, time);
+    video->seek_time = time;
+    video->seek_at = SDL_GetPerformanceCounter();
+    video->next_seek = -1;
+}
+
+// Pause the video and show the frame at position instead, in milliseconds.
+// The first position given is wherever the video was, and later ones move it
+// by how far position has moved since, so it can be something like the angle
+// of the Tracker.  Only one seek is given to VLC at a time, with the latest
+// time asked for in the meantime seeked to after it, so it never falls behind
+// the Tracker.  Frames it has already decoded while scrubbing are shown right
+// away.
+void sosg_video_scrub(sosg_video_p video, int64_t position)
+{
+    int i;
+
+    if (!video) return;
+
+    if (!SDL_AtomicGet(&video->scrubbing)) {
+        libvlc_media_player_set_pause(video->mp, 1);
+        video->origin = libvlc_media_player_get_time(video->mp) - position;
+        SDL_AtomicSet(&video->scrubbing, 1);
+        video->fps = libvlc_media_player_get_fps(video->mp);
+        if (video->fps <= 0.0) video->fps = 25.0;
+        video->target = video->seek_time = video->next_seek = -1;
+        // The video has moved on since any last time
+        video->cached = -1;
+        for (i = 0; i < SCRUB_FRAMES; i++) video->cache_time[i] = -1;
+    }
+
+    // Snap to the start of a frame within the video, so the same frame is
+    // always at the same time
+    int64_t time = video->origin + position;
+    int64_t length = libvlc_media_player_get_length(video->mp);
+    if (length > 0) time = SDL_min(time, length - (int64_t)(1000.0/video->fps));
+    time = SDL_max(time, 0);
+    int64_t frame = (int64_t)(time*video->fps/1000.0);
+    time = (int64_t)ceil(frame*1000.0/video->fps);
+    if (time == video->target) return;
+    video->target = time;
+
+    i = find_cached(video, time);
+    if (i >= 0) {
+        video->cached = i;
+        video->next_seek = -1;
+    } else if (video->seek_time >= 0) {
+        video->next_seek = time;
+    } else {
+        seek(video, time);
+    }
+}
+
+// Carry on playing from where the video was scrubbed to
+void sosg_video_play(sosg_video_p video)
+{
+    if (video && SDL_AtomicGet(&video->scrubbing)) {
+        SDL_AtomicSet(&video->scrubbing, 0);
+        libvlc_media_player_set_pause(video->mp, 0);
+    }
+}
+
+// Point the frame at a slot, which is the format it was decoded at, even if
+// that changed since
+static sosg_frame_p show_slot(sosg_video_p video, slot_p slot)
+{
+    unsigned pitches[3], lines[3];
+    int i, format = slot->format;
+
+    video->frame.w = FORMAT_W(format);
+    video->frame.h = FORMAT_H(format);
+    video->frame.pts = slot->pts;
+    video->frame.overlaid = slot->overlaid;
+    video->frame.surface = slot->surface;
+    video->frame.data = slot->pixels;
+    video->frame.format = FORMAT_PLANAR(format) ? SOSG_FRAME_I420 : SOSG_FRAME_BGRA;
+    video->frame.levels = FORMAT_PLANAR(format) ? 3 : 1;
+    layout(format, pitches, lines);
+    for (i = 0; i < video->frame.levels; i++) {
+        video->frame.pitches[i] = pitches[i];
+        video->frame.sizes[i] = pitches[i]*lines[i];
+    }
+
+    return &video->frame;
+}
+
+static sosg_frame_p update_scrub(sosg_video_p video)
+{
+    slot_p slot;
+    slot_p latest = NULL;
+    int64_t time = -1;
+    uint64_t now = SDL_GetPerformanceCounter();
+
+    // The frame VLC shows after a seek is the one at the time it seeked to.
+    // Any others were already on their way before it.
+    while (!sosg_queue_pop(video->ready, &slot)) {
+        if (video->seek_time < 0 || slot->pts < video->seek_at) {
+            release(slot);
+            continue;
+        }
+        time = video->seek_time;
+        cache_slot(video, slot, time);
+        video->seek_time = -1;
+        latest = slot;
+    }
+
+    // Give up on a seek that never shows a frame, like one past the end
+    if (video->seek_time >= 0 &&
+        (now - video->seek_at)*1000 > SEEK_TIMEOUT*SDL_GetPerformanceFrequency()) {
+        video->seek_time = -1;
+    }
+    if (video->seek_time < 0 && video->next_seek >= 0) seek(video, video->next_seek);
+
+    // A frame that was already decoded for where the video is now beats one
+    // that only just caught up with where it was
+    if (video->cached >= 0) {
+        if (latest) release(latest);
+        video->showing = video->cached;
+        video->cached = -1;
+        return show_slot(video, video->cache + video->showing);
+    }
+    if (!latest) return NULL;
+    if (time != video->target && find_cached(video, video->target) >= 0) {
+        release(latest);
+        return NULL;
+    }
+
+    video->shown++;
+    if (video->current) release(video->current);
+    video->current = latest;
+    video->showing = -1;
+    return show_slot(video, latest);
+}
+
+sosg_frame_p sosg_video_update(sosg_video_p video)
+{
+    slot_p slot;
+    slot_p latest = NULL;
+
+    if (!video) return NULL;
+
+    // Remember whether the renderer drew into the cached frame on screen
+    if (video->showing >= 0) video->cache[video->showing].overlaid = video->frame.overlaid;
+    if (SDL_AtomicGet(&video->scrubbing)) return update_scrub(video);
+
+    // Only pass a frame if VLC displayed a new frame since the last one, and
+    // skip past any that piled up since then, leaving the ones that are for
+    // a later refresh
+    uint64_t now = SDL_GetPerformanceCounter();
+    while (!sosg_queue_peek(video->ready, &slot) && is_due(video, slot, now)) {
+        sosg_queue_pop(video->ready, &slot);
+        if (latest) release(latest);
+        latest = slot;
+    }
+    if (!latest) return NULL;
+
+    // Sequence numbers from the same output thread count the frames that
+    // were displayed by VLC but never made it to the screen
+    if (video->last_seq) video->skipped += latest->seq - video->last_seq - 1;
+    video->last_seq = latest->seq;
+    video->shown++;
 
-    return video->surface;
+    // The previous frame was kept until now since the software renderer
+    // keeps drawing from it between updates
+    if (video->current) release(video->current);
+    video->current = latest;
+    video->showing = -1;
+    return show_slot(video, latest);
 }
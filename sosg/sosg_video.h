@@ -3,13 +3,24 @@
 
 #include "SDL.h"
 #include "SDL_image.h"
+#include "sosg_frame.h"
+
+// Frames VLC can be decoding or showing at once
+#define SOSG_VIDEO_SLOTS 8
 
 typedef struct sosg_video_struct *sosg_video_p;
 
-sosg_video_p sosg_video_init(int num_paths, char *paths[]);
+sosg_video_p sosg_video_init(int num_paths, char *paths[], int huge);
 void sosg_video_destroy(sosg_video_p video);
 void sosg_video_get_resolution(sosg_video_p video, int *resolution);
 void sosg_video_set_index(sosg_video_p video, int index);
-SDL_Surface *sosg_video_update(sosg_video_p video);
+void sosg_video_set_planar(sosg_video_p video, int max_size);
+void sosg_video_set_memory(sosg_video_p video, uint8_t *memory, size_t frame_size);
+void sosg_video_set_clock(sosg_video_p video, uint64_t vsync, uint64_t period);
+int sosg_video_get_delay(sosg_video_p video);
+void sosg_video_get_stats(sosg_video_p video, int *shown, int *skipped);
+void sosg_video_scrub(sosg_video_p video, int64_t position);
+void sosg_video_play(sosg_video_p video);
+sosg_frame_p sosg_video_update(sosg_video_p video);
 
 #endif /* _SOSG_VIDEO_H_ */
@@ -0,0 +1,194 @@
+/*
+Filename:     sosgpack.c
+Content:      Dataset packing tool for Science on a Snow Globe
+Authors:      Nirav Patel
+Copyright:    Copyright (c) 2011-2017, Nirav Patel <nrp@eclecti.cc>
+
+    Permission to use, copy, modify, and/or distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+    WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+    MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+    ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+    WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+    ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+    OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "SDL.h"
+#include "SDL_image.h"
+
+#include "sosg_pack.h"
+#include "sosg_ktx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Decodes a list of images once into a pack that sosg can map and show
+// without decoding or copying anything
+
+static void usage(void)
+{
+    printf("Usage: sosgpack [OPTION] OUTPUT [FILES]\n\n");
+    printf("Packs images into a sosg pack that sosg -i can show without decoding.\n");
+    printf("Every image must have the same resolution as the first.\n\n");
+    printf("        -k     Compress the frames to DXT1\n\n");
+}
+
+static int load_frame(const char *path, int compress, sosg_frame_p frame)
+{
+    SDL_Surface *surface = IMG_Load(path);
+    if (!surface) {
+        fprintf(stderr, "Error: Could not load %s: %s\n", path, IMG_GetError());
+        return -1;
+    }
+
+    // The same layout sosg_image would decode to, so rows are tightly packed
+    SDL_Surface *buffer = SDL_CreateRGBSurface(SDL_SWSURFACE, 
+        surface->w, surface->h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    if (buffer) SDL_BlitSurface(surface, NULL, buffer, NULL);
+    SDL_FreeSurface(surface);
+    if (!buffer) return -1;
+
+    if (compress) {
+        int ret = sosg_ktx_encode(buffer, frame);
+        SDL_FreeSurface(buffer);
+        return ret;
+    }
+
+    memset(frame, 0, sizeof(sosg_frame_t));
+    frame->format = SOSG_FRAME_BGRA;
+    frame->w = buffer->w;
+    frame->h = buffer->h;
+    frame->surface = buffer;
+    return 0;
+}
+
+static int write_frame(FILE *file, sosg_frame_p frame, uint64_t *size)
+{
+    int i;
+
+    *size = 0;
+    if (frame->surface) {
+        SDL_Surface *surface = frame->surface;
+        for (i = 0; i < surface->h; i++) {
+            if (fwrite((uint8_t *)surface->pixels + i*surface->pitch, surface->w*4, 1, file) != 1)
+                return -1;
+        }
+        *size = (uint64_t)surface->w*surface->h*4;
+    } else {
+        for (i = 0; i < frame->levels; i++) *size += frame->sizes[i];
+        if (fwrite(frame->data, *size, 1, file) != 1) return -1;
+    }
+
+    // Pad so the next frame starts on a page
+    long pad = (SOSG_PACK_ALIGN - ftell(file) % SOSG_PACK_ALIGN) % SOSG_PACK_ALIGN;
+    while (pad--) fputc(0, file);
+
+    return 0;
+}
+
+static void free_frame(sosg_frame_p frame)
+{
+    if (frame->surface) SDL_FreeSurface(frame->surface);
+    frame->surface = NULL;
+    sosg_ktx_free(frame);
+}
+
+int main(int argc, char *argv[])
+{
+    int c, i;
+    int compress = 0;
+    int ret = 0;
+    sosg_pack_header_t header;
+    sosg_pack_entry_t *entries;
+    sosg_frame_t frame;
+
+    while ((c = getopt(argc, argv, "k")) != -1) {
+        switch (c) {
+            case 'k':
+                compress = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage();
+        fprintf(stderr, "Error: Missing output or images.\n");
+        return 1;
+    }
+
+    const char *output = argv[optind];
+    char **paths = argv + optind + 1;
+    int num_paths = argc - optind - 1;
+
+    entries = calloc(num_paths, sizeof(sosg_pack_entry_t));
+    FILE *file = fopen(output, "wb");
+    if (!entries || !file) {
+        fprintf(stderr, "Error: Could not create %s\n", output);
+        return 1;
+    }
+
+    // The index is written once all the frames are, so leave space for it
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(entries, sizeof(sosg_pack_entry_t), num_paths, file);
+    long pad = (SOSG_PACK_ALIGN - ftell(file) % SOSG_PACK_ALIGN) % SOSG_PACK_ALIGN;
+    while (pad--) fputc(0, file);
+
+    for (i = 0; i < num_paths; i++) {
+        if (load_frame(paths[i], compress, &frame)) {
+            ret = 1;
+            break;
+        }
+
+        if (!header.num_frames) {
+            memcpy(header.magic, SOSG_PACK_MAGIC, sizeof(header.magic));
+            header.version = SOSG_PACK_VERSION;
+            header.w = frame.w;
+            header.h = frame.h;
+            header.format = frame.format;
+            header.internal = frame.internal;
+            header.levels = frame.levels;
+            for (c = 0; c < frame.levels; c++) header.sizes[c] = frame.sizes[c];
+        } else if (frame.w != header.w || frame.h != header.h) {
+            fprintf(stderr, "Error: %s is %dx%d instead of %ux%u\n", paths[i],
+                frame.w, frame.h, header.w, header.h);
+            free_frame(&frame);
+            ret = 1;
+            break;
+        }
+
+        entries[header.num_frames].offset = ftell(file);
+        if (write_frame(file, &frame, &entries[header.num_frames].size)) {
+            fprintf(stderr, "Error: Could not write to %s\n", output);
+            free_frame(&frame);
+            ret = 1;
+            break;
+        }
+        header.num_frames++;
+        free_frame(&frame);
+        printf("Packed %s (%d/%d)\n", paths[i], i + 1, num_paths);
+    }
+
+    if (!ret) {
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(entries, sizeof(sosg_pack_entry_t), header.num_frames, file);
+    }
+    if (fclose(file) || ret) {
+        fprintf(stderr, "Error: Failed to write %s\n", output);
+        remove(output);
+        ret = 1;
+    }
+
+    free(entries);
+    return ret;
+}